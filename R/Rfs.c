@@ -181,10 +181,10 @@ SEXP rfs_particles_with_id(SEXP indices)
 
   Particle const * const p= particles->p;
   for(int i=0; i<nrow; i++) {
-    rx[i]= p[index[i]].x[0];
-    ry[i]= p[index[i]].x[1];
-    rz[i]= p[index[i]].x[2];
-    ii[i]= (int) p[index[i]].id;
+    rx[i]= pos_to_x(p[index[i]].x[0], boxsize);
+    ry[i]= pos_to_x(p[index[i]].x[1], boxsize);
+    rz[i]= pos_to_x(p[index[i]].x[2], boxsize);
+    ii[i]= (int) particle_id(p + index[i]);
   }
 
   // set the vectors in list$x <- x ...
@@ -237,9 +237,12 @@ SEXP rfs_particles_in_cuboid(SEXP cuboid)
   Particle* p= particles->p;
   for(size_t i=0; i<np; i++) {
     periodic_wrapup_p(p + i, boxsize);
-    if(left[0] <= p[i].x[0] && p[i].x[0] < right[0] &&
-       left[1] <= p[i].x[1] && p[i].x[1] < right[1] &&
-       left[2] <= p[i].x[2] && p[i].x[2] < right[2])
+    const float_t x[]= {pos_to_x(p[i].x[0], boxsize),
+			pos_to_x(p[i].x[1], boxsize),
+			pos_to_x(p[i].x[2], boxsize)};
+    if(left[0] <= x[0] && x[0] < right[0] &&
+       left[1] <= x[1] && x[1] < right[1] &&
+       left[2] <= x[2] && x[2] < right[2])
       //printf("%e %e %e\n", p[i].x[0], p[i].x[1], p[i].x[2]);
       count++;
   }
@@ -286,14 +289,17 @@ SEXP rfs_particles_in_cuboid(SEXP cuboid)
   //Particle const * const p= particles->p;
   size_t index= 0;
   for(int i=0; i<np; i++) {
-    if(left[0] <= p[i].x[0] && p[i].x[0] < right[0] &&
-       left[1] <= p[i].x[1] && p[i].x[1] < right[1] &&
-       left[2] <= p[i].x[2] && p[i].x[2] < right[2]) {
-
-      rx[index]= p[i].x[0];
-      ry[index]= p[i].x[1];
-      rz[index]= p[i].x[2];
-      ii[index]= (int) p[i].id;
+    const float_t x[]= {pos_to_x(p[i].x[0], boxsize),
+			pos_to_x(p[i].x[1], boxsize),
+			pos_to_x(p[i].x[2], boxsize)};
+    if(left[0] <= x[0] && x[0] < right[0] &&
+       left[1] <= x[1] && x[1] < right[1] &&
+       left[2] <= x[2] && x[2] < right[2]) {
+
+      rx[index]= x[0];
+      ry[index]= x[1];
+      rz[index]= x[2];
+      ii[index]= (int) particle_id(p + i);
 
       index++;
     }
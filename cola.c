@@ -2,7 +2,6 @@
 #include <assert.h>
 #include <mpi.h>
 
-#include <gsl/gsl_integration.h>
 #include <gsl/gsl_roots.h>
 #include <gsl/gsl_sf_hyperg.h> 
 #include <gsl/gsl_errno.h>
@@ -14,10 +13,35 @@
 #include "write.h"
 
 static float Om= -1.0f;
-static const float nLPT= -2.5f;
+static const double nLPT= COSMOLOGY_N_COLA;
 
 double Sq(double ai, double af, double aRef);
 
+static const float_t zero_force[3]= {0, 0, 0};
+
+static float_t kick_force_factor(Particles const * const particles,
+				 const double avel1)
+{
+  // Velocity change per unit force, PM or LPT, for the kick from
+  // a_v to avel1 with the acceleration at a_x
+  const double ai=  particles->a_v;  // t - 0.5*dt
+  const double a=   particles->a_x;  // t
+  const double af=  avel1;           // t + 0.5*dt
+  const double om=  particles->omega_m;
+
+  const float_t kick_factor= (pow(af, nLPT) - pow(ai, nLPT))/
+                             (nLPT*pow(a, nLPT)*sqrt(om/a+(1.0-om)*a*a));
+  return -1.5*om*kick_factor;
+}
+
+float_t cola_force_factor(Particles const * const particles,
+			  const double avel1)
+{
+  // Velocity change per unit PM force in cola_kick(particles, avel1), for
+  // pm_compute_forces_kick()
+  return kick_force_factor(particles, avel1);
+}
+
 void cola_kick(Particles* const particles, const double avel1)
 {
   const double ai=  particles->a_v;  // t - 0.5*dt
@@ -25,36 +49,35 @@ void cola_kick(Particles* const particles, const double avel1)
   const double af=  avel1;           // t + 0.5*dt
 
   Om= particles->omega_m;
-  msg_printf(msg_info, "Kick %lg -> %lg\n", ai, avel1);
+  msg_printf(msg_info, "Kick %lg -> %lg\n", ai, af);
 
-  const float_t kick_factor= (pow(af, nLPT) - pow(ai, nLPT))/
-                             (nLPT*pow(a, nLPT)*sqrt(Om/a+(1.0-Om)*a*a));
+  const float_t fac= kick_force_factor(particles, avel1);
   const double growth1= cosmology_D_growth(a);
   const double growth2= cosmology_D2_growth(a, growth1);
 	
   msg_printf(msg_debug, "growth factor %lg\n", growth1);
 
-  const float_t q1= growth1;
-  const float_t q2= cosmology_D2a_growth(growth1, growth2);
-
+  float_t q1[3], q2[3];
+  for(int k=0; k<3; k++) {
+    q1[k]= growth1*particles->dx1_unit[k];
+    q2[k]= cosmology_D2a_growth(growth1, growth2)*particles->dx2_unit[k];
+  }
   
   Particle* const p= particles->p;
   const int np= particles->np_local;
   float3* const f= particles->force;
 
   // Kick using acceleration at scale factor a
-  // Assume forces at a is in particles->force
+  // Assume forces at a is in particles->force; if particles->force is 0,
+  // pm_compute_forces_kick() has already added the PM force
 #ifdef _OPENMP
   #pragma omp parallel for default(shared)
 #endif
   for(size_t i=0; i<np; i++) {
-    float_t ax= -1.5*Om*(f[i][0] + p[i].dx1[0]*q1 + p[i].dx2[0]*q2);
-    float_t ay= -1.5*Om*(f[i][1] + p[i].dx1[1]*q1 + p[i].dx2[1]*q2);
-    float_t az= -1.5*Om*(f[i][2] + p[i].dx1[2]*q1 + p[i].dx2[2]*q2);
-
-    p[i].v[0] += ax*kick_factor;
-    p[i].v[1] += ay*kick_factor;
-    p[i].v[2] += az*kick_factor;
+    float_t const * const fi= f ? f[i] : zero_force;
+    p[i].v[0] += fac*(fi[0] + p[i].dx1[0]*q1[0] + p[i].dx2[0]*q2[0]);
+    p[i].v[1] += fac*(fi[1] + p[i].dx1[1]*q1[1] + p[i].dx2[1]*q2[1]);
+    p[i].v[2] += fac*(fi[2] + p[i].dx1[2]*q1[2] + p[i].dx2[2]*q2[2]);
 
   }
 
@@ -70,15 +93,21 @@ void cola_drift(Particles* const particles, const double apos1)
   
   Particle* const p= particles->p;
   const size_t np= particles->np_local;
+  const float_t boxsize= particles->boxsize;
 
   const double dt=Sq(ai, af, particles->a_v);
 
   const double growth_i= cosmology_D_growth(ai);
   const double growth_f= cosmology_D_growth(af);
-  const float_t da1= growth_f - growth_i;
-
-  const float_t da2= cosmology_D2_growth(af, growth_f) -
-                     cosmology_D2_growth(ai, growth_i);
+  const double dgrowth1= growth_f - growth_i;
+  const double dgrowth2= cosmology_D2_growth(af, growth_f) -
+                         cosmology_D2_growth(ai, growth_i);
+
+  float_t da1[3], da2[3];
+  for(int k=0; k<3; k++) {
+    da1[k]= dgrowth1*particles->dx1_unit[k];
+    da2[k]= dgrowth2*particles->dx2_unit[k];
+  }
 
   msg_printf(msg_info, "Drift %lg -> %lg\n", ai, af);
     
@@ -87,19 +116,82 @@ void cola_drift(Particles* const particles, const double apos1)
   #pragma omp parallel for default(shared)
 #endif
   for(int i=0; i<np; i++) {
-    p[i].x[0] += p[i].v[0]*dt + 
-                 (p[i].dx1[0]*da1 + p[i].dx2[0]*da2);
-    p[i].x[1] += p[i].v[1]*dt +
-                 (p[i].dx1[1]*da1 + p[i].dx2[1]*da2);
-    p[i].x[2] += p[i].v[2]*dt + 
-                 (p[i].dx1[2]*da1 + p[i].dx2[2]*da2);
+    p[i].x[0]= pos_add(p[i].x[0], p[i].v[0]*dt + 
+                 (p[i].dx1[0]*da1[0] + p[i].dx2[0]*da2[0]), boxsize);
+    p[i].x[1]= pos_add(p[i].x[1], p[i].v[1]*dt +
+                 (p[i].dx1[1]*da1[1] + p[i].dx2[1]*da2[1]), boxsize);
+    p[i].x[2]= pos_add(p[i].x[2], p[i].v[2]*dt + 
+                 (p[i].dx1[2]*da1[2] + p[i].dx2[2]*da2[2]), boxsize);
   }
 
   particles->a_x= af;
 }
 
-double fun (double a, void * params) {
-  return pow(a, nLPT)/(sqrt(Om/(a*a*a)+1.0-Om)*a*a*a);
+static inline pos_t periodic_wrap(pos_t x, const float_t boxsize)
+{
+  // Nothing to do for FIXED_POSITION, periodic by construction
+#ifndef FIXED_POSITION
+  if(x < 0) x += boxsize;
+  else if(x >= boxsize) x -= boxsize;
+#endif
+  return x;
+}
+
+void cola_kick_drift(Particles* const particles, const double avel1,
+		     const double apos1)
+{
+  // cola_kick(particles, avel1) followed by cola_drift(particles, apos1)
+  // and the periodic wrap of positions, in one pass over the particles.
+  // The PM force is not used if particles->force is 0, as in cola_kick()
+  const double ai=  particles->a_v;  // t - 0.5*dt
+  const double a=   particles->a_x;  // t
+  const double apos0= a;
+
+  Om= particles->omega_m;
+  msg_printf(msg_info, "Kick %lg -> %lg, drift %lg -> %lg\n",
+	     ai, avel1, apos0, apos1);
+
+  // kick
+  const float_t fac= kick_force_factor(particles, avel1);
+  const double growth1= cosmology_D_growth(a);
+  const double growth2= cosmology_D2_growth(a, growth1);
+
+  // drift with velocity at avel1
+  const float_t dt= Sq(apos0, apos1, avel1);
+
+  const double growth_f= cosmology_D_growth(apos1);
+  const double growth2_f= cosmology_D2_growth(apos1, growth_f);
+
+  float_t q1[3], q2[3], da1[3], da2[3];
+  for(int k=0; k<3; k++) {
+    q1[k]= growth1*particles->dx1_unit[k];
+    q2[k]= cosmology_D2a_growth(growth1, growth2)*particles->dx2_unit[k];
+    da1[k]= (growth_f - growth1)*particles->dx1_unit[k];
+    da2[k]= (growth2_f - growth2)*particles->dx2_unit[k];
+  }
+
+  const float_t boxsize= particles->boxsize;
+  Particle* const p= particles->p;
+  const size_t np= particles->np_local;
+  float3* const f= particles->force;
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t i=0; i<np; i++) {
+    float_t const * const fi= f ? f[i] : zero_force;
+    for(int k=0; k<3; k++) {
+      const float_t dx1= p[i].dx1[k], dx2= p[i].dx2[k];
+      const float_t v= p[i].v[k] + fac*(fi[k] + dx1*q1[k] + dx2*q2[k]);
+      p[i].v[k]= v;
+      p[i].x[k]= periodic_wrap(pos_add(p[i].x[k],
+				       v*dt + dx1*da1[k] + dx2*da2[k], boxsize),
+			       boxsize);
+    }
+  }
+
+  particles->a_v= avel1;
+  particles->a_x= apos1;
 }
 
 double Sq(double ai, double af, double av) {
@@ -108,22 +200,5 @@ double Sq(double ai, double af, double av) {
   // = \int_ai^af (a/a(av))^nLPT da/(a^3 H(a))
   //
   assert(ai > 0.0);
-  printf("Sq %e %e %e\n", ai, af, av); //abort();
-  gsl_integration_workspace * w 
-    = gsl_integration_workspace_alloc (5000);
-  
-  double result, error;
-  double alpha= 0;
-  
-  gsl_function F;
-  F.function = &fun;
-  F.params = &alpha;
-  
-  gsl_integration_qag (&F, ai, af, 0, 1e-5, 5000, 6,
-		       w, &result, &error); 
-  
-  gsl_integration_workspace_free (w);
-     
-  return result/pow(av, nLPT);
+  return cosmology_drift_integral(ai, af, nLPT)/pow(av, nLPT);
 }
-
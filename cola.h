@@ -2,6 +2,10 @@
 #define COLA_H 1
 
 void cola_kick(Particles* const particles, const double a_vel1);
+float_t cola_force_factor(Particles const * const particles,
+			  const double a_vel1);
 void cola_drift(Particles* const particles, const double a_pos1);
+void cola_kick_drift(Particles* const particles, const double a_vel1,
+		     const double a_pos1);
 
 #endif
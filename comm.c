@@ -66,6 +66,20 @@ void comm_bcast_double(double* p_double, int count)
   MPI_Bcast(p_double, count, MPI_DOUBLE, 0, MPI_COMM_WORLD);
 }
 
+void comm_max_double(double* p_double, int count)
+{
+  // Maximum over all nodes, in place
+  MPI_Allreduce(MPI_IN_PLACE, p_double, count, MPI_DOUBLE, MPI_MAX,
+		MPI_COMM_WORLD);
+}
+
+void comm_sum_double(double* p_double, int count)
+{
+  // Sum over all nodes, in place
+  MPI_Allreduce(MPI_IN_PLACE, p_double, count, MPI_DOUBLE, MPI_SUM,
+		MPI_COMM_WORLD);
+}
+
 #else
 
 //
@@ -96,6 +110,14 @@ void comm_bcast_double(double* p_double, int count)
 {
 }
 
+void comm_max_double(double* p_double, int count)
+{
+}
+
+void comm_sum_double(double* p_double, int count)
+{
+}
+
 #endif
 
 //
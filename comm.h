@@ -8,4 +8,6 @@ int comm_this_node(void);
 int comm_n_nodes(void);
 void comm_bcast_int(int* p_int, int count);
 void comm_bcast_double(double* p_double, int count);
+void comm_max_double(double* p_double, int count);
+void comm_sum_double(double* p_double, int count);
 #endif
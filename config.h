@@ -12,10 +12,12 @@
 #ifdef DOUBLEPRECISION
 typedef double float_t;
 typedef fftw_complex complex_t;
+#define FLOAT_TYPE MPI_DOUBLE
 #define FLOAT_EPS 1.0e-15
 #else
 typedef fftwf_complex complex_t;
 typedef float float_t;
+#define FLOAT_TYPE MPI_FLOAT
 #define FLOAT_EPS 1.0e-7f
 #endif
 
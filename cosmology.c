@@ -6,21 +6,41 @@
 ///
 
 #include <math.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_integration.h>
 #include "msg.h"
 #include "cosmology.h"
 
+// Integrals over a tabulated at nodes uniform in log a,
+//   log a_i = (i - NTABLE_I0)/NTABLE_DIV, a_i = 9.9e-5 ... 4.05,
+// and interpolated by cubic Hermite polynomials with the integrands as
+// derivatives. Outside the table the integrals are computed directly.
+#define NTABLE 1360
+#define NTABLE_I0 1180
+#define NTABLE_DIV 128.0
+
+enum {table_growth, table_kick, table_drift, table_drift_cola, ntable};
+static const double n_cola= COSMOLOGY_N_COLA;
+
 static double omega_m0;
 static double growth_normalisation;
+static double table_y[ntable][NTABLE];  // integral
+static double table_dy[ntable][NTABLE]; // d(integral)/d(log a)
 
 static double growth_integrand(double a, void* param);
 static double growth_unnormalised(const double a);
+static double kick_integrand(double a, void* param);
+static double drift_integrand(double a, void* param);
+static double integrate(double (*f)(double, void*), void* param,
+			const double a0, const double a1);
+static void table_init(void);
 
 void cosmology_init(const double omega_m0_)
 {
   omega_m0= omega_m0_;
+  table_init();
   growth_normalisation= 1.0/growth_unnormalised(1.0); // D_growth=1 at a=1
 }
 
@@ -49,6 +69,23 @@ double cosmology_D2_growth(const double a, const double D)
   return -3.0/7.0*D*D*pow(cosmology_omega(a), -1.0/143.0);
 }
 
+double cosmology_D3a_growth(const double a, const double D)
+{
+  // 3rd-order growth factor D3a for the det(Psi_i,j) term
+  // Bouchet et al. (1995) fit
+  if(a == 0.0) return 0.0;
+
+  return -1.0/3.0*D*D*D*pow(cosmology_omega(a), -4.0/275.0);
+}
+
+double cosmology_D3b_growth(const double a, const double D)
+{
+  // 3rd-order growth factor D3b for the Psi(1)-Psi(2) interaction term
+  if(a == 0.0) return 0.0;
+
+  return 10.0/21.0*D*D*D*pow(cosmology_omega(a), -269.0/17875.0);
+}
+
 double cosmology_Dv_growth(const double a, const double D)
 {
   assert(a > 0);
@@ -67,6 +104,15 @@ double cosmology_D2v_growth(const double a, const double D2)
   return 2.0*a*a*D2*H*f;
 }
 
+double cosmology_D3v_growth(const double a, const double D3)
+{
+  // Velocity factor of the 3rd-order displacement, D3 propto D^3
+  double H= cosmology_hubble_function(a);
+  double f= cosmology_f_growth_rate(a);
+
+  return 3.0*a*a*D3*H*f;
+}
+
 double cosmology_D2a_growth(const double D1, const double D2)
 {
   return D2 - D1*D1;
@@ -105,6 +151,56 @@ void cosmology_growth(const double a,
   *f_result= 1.0/(d_un*a*a*hf*hf) - 1.5*omega_m0/(hf*hf*a*a*a);   
 }
 
+static inline bool table_covers(const double a)
+{
+  return a >= exp(-NTABLE_I0/NTABLE_DIV) &&
+         a <= exp((NTABLE - 1 - NTABLE_I0)/NTABLE_DIV);
+}
+
+static inline double table_eval(const int t, const double a)
+{
+  // Cubic Hermite interpolation in log a; O(1), thread safe
+  double u= log(a)*NTABLE_DIV + NTABLE_I0;
+  int i= (int) floor(u);
+  if(i >= NTABLE - 1) i= NTABLE - 2;
+  if(i < 0) i= 0;
+
+  const double s= u - i;
+  const double s2= s*s, s3= s2*s;
+  const double h= 1.0/NTABLE_DIV;
+
+  return (2.0*s3 - 3.0*s2 + 1.0)*table_y[t][i]
+       + (s3 - 2.0*s2 + s)*h*table_dy[t][i]
+       + (-2.0*s3 + 3.0*s2)*table_y[t][i + 1]
+       + (s3 - s2)*h*table_dy[t][i + 1];
+}
+
+double cosmology_kick_integral(const double ai, const double af)
+{
+  // \int_ai^af da/(a^2 H(a)/H0), leapfrog kick factor
+  if(table_covers(ai) && table_covers(af))
+    return table_eval(table_kick, af) - table_eval(table_kick, ai);
+
+  return integrate(kick_integrand, 0, ai, af);
+}
+
+double cosmology_drift_integral(const double ai, const double af,
+				const double n)
+{
+  // \int_ai^af a^n da/(a^3 H(a)/H0), drift factor; tabulated for n=0
+  // (leapfrog) and n=COSMOLOGY_N_COLA, which cola.c passes exactly
+  if(table_covers(ai) && table_covers(af)) {
+    if(n == 0.0)
+      return table_eval(table_drift, af) - table_eval(table_drift, ai);
+    else if(n == n_cola)
+      return table_eval(table_drift_cola, af) -
+	     table_eval(table_drift_cola, ai);
+  }
+
+  double param= n;
+  return integrate(drift_integrand, &param, ai, af);
+}
+
 double cosmology_hubble_function(const double a)
 {
   // H/H0= sqrt(Omega_m0*a^-3 + Omega_Lambda)
@@ -128,20 +224,79 @@ double growth_integrand(double a, void* param)
 double growth_unnormalised(const double a)
 {
   // D(a) \propto \int_0^a (a H(a)/H0)^-3 da
+  if(table_covers(a))
+    return cosmology_hubble_function(a) * table_eval(table_growth, a);
+  
+  return cosmology_hubble_function(a) * integrate(growth_integrand, 0, 0, a);
+}
+
+double kick_integrand(double a, void* param)
+{
+  // 1/(a^2 H/H0)
+  return 1.0/(a*a*cosmology_hubble_function(a));
+}
+
+double drift_integrand(double a, void* param)
+{
+  // a^n/(a^3 H/H0)
+  const double n= *(double*) param;
+  return pow(a, n)/(a*a*a*cosmology_hubble_function(a));
+}
+
+double integrate(double (*f)(double, void*), void* param,
+		 const double a0, const double a1)
+{
   const size_t worksize= 1000;
 
   gsl_integration_workspace *workspace=
     gsl_integration_workspace_alloc(worksize);
 
   gsl_function F;
-  F.function = &growth_integrand;
+  F.function = f;
+  F.params = param;
 
   double result, abserr;
-  gsl_integration_qag(&F, 0, a, 0, 0.5e-8, worksize, GSL_INTEG_GAUSS41,
+  gsl_integration_qag(&F, a0, a1, 0, 0.5e-8, worksize, GSL_INTEG_GAUSS41,
 		      workspace, &result, &abserr);
 
   gsl_integration_workspace_free(workspace);
 
-  return cosmology_hubble_function(a) * result;
+  return result;
+}
+
+void table_init(void)
+{
+  // Integrals from 0 (growth) or from a=1 (kick and drift) to the nodes,
+  // summed interval by interval
+  double n_drift= 0.0;
+  double (*f[])(double, void*)= {growth_integrand, kick_integrand,
+				 drift_integrand, drift_integrand};
+  void* param[]= {0, 0, &n_drift, (void*) &n_cola};
+
+  for(int t=0; t<ntable; t++) {
+    for(int i=0; i<NTABLE; i++) {
+      const double a= exp((i - NTABLE_I0)/NTABLE_DIV);
+      table_dy[t][i]= a*f[t](a, param[t]);
+    }
+  }
+
+  table_y[table_growth][0]=
+    integrate(growth_integrand, 0, 0, exp(-NTABLE_I0/NTABLE_DIV));
+  for(int i=1; i<NTABLE; i++)
+    table_y[table_growth][i]= table_y[table_growth][i - 1] +
+      integrate(growth_integrand, 0, exp((i - 1 - NTABLE_I0)/NTABLE_DIV),
+		exp((i - NTABLE_I0)/NTABLE_DIV));
+
+  for(int t=table_kick; t<ntable; t++) {
+    table_y[t][NTABLE_I0]= 0.0;
+    for(int i=NTABLE_I0 + 1; i<NTABLE; i++)
+      table_y[t][i]= table_y[t][i - 1] +
+	integrate(f[t], param[t], exp((i - 1 - NTABLE_I0)/NTABLE_DIV),
+		  exp((i - NTABLE_I0)/NTABLE_DIV));
+    for(int i=NTABLE_I0 - 1; i>=0; i--)
+      table_y[t][i]= table_y[t][i + 1] -
+	integrate(f[t], param[t], exp((i - NTABLE_I0)/NTABLE_DIV),
+		  exp((i + 1 - NTABLE_I0)/NTABLE_DIV));
+  }
 }
 
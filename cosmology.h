@@ -1,6 +1,10 @@
 #ifndef COSMOLOGY_H
 #define COSMOLOGY_H 1
 
+// Exponent n of the COLA time stepping in a^n (nLPT in cola.c); the drift
+// integral for this n is tabulated
+#define COSMOLOGY_N_COLA (-2.5)
+
 void   cosmology_init(const double omega_m0);
 void cosmology_check(void);
 
@@ -9,11 +13,18 @@ double cosmology_D2_growth(const double a, const double D);
 double cosmology_Dv_growth(const double a, const double D);
 double cosmology_D2v_growth(const double a, const double D2);
 double cosmology_D2a_growth(const double D1, const double D2);
+double cosmology_D3a_growth(const double a, const double D);
+double cosmology_D3b_growth(const double a, const double D);
+double cosmology_D3v_growth(const double a, const double D3);
 
 void   cosmology_growth(const double a, double* const D, double* const f);
 
 double cosmology_f_growth_rate(const double a);
 
+double cosmology_kick_integral(const double ai, const double af);
+double cosmology_drift_integral(const double ai, const double af,
+				const double n);
+
 double cosmology_hubble_function(const double a);
 double cosmology_omega(const double a);
 
@@ -0,0 +1,285 @@
+///
+/// \file  domain.c
+/// \brief Moves particles to the node that owns their PM x-slab (pencil)
+///
+
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include <mpi.h>
+#include "config.h"
+#include "msg.h"
+#include "comm.h"
+#include "particle.h"
+#include "fft.h"
+#include "domain.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static int this_node, n_nodes;
+static int nc, local_ix0, local_nx, local_iy0, local_ny;
+static float_t boxsize;
+static int *owner_x, *owner_y; // node owning mesh (ix, iy) is the sum
+static int *nsend, *nrecv, *send_displ, *recv_displ;
+
+static size_t nsend_alloc;
+static Particle* buf_send;
+
+static MPI_Datatype particle_type;
+
+// Load imbalance, gathered to node 0 once per decomposition
+static const double imbalance_report= 1.2; // msg_info above this max/mean
+static unsigned long* np_gather; // np_local and particles sent, per node
+
+// Sort by PM mesh column
+static size_t* sort_count;   // column counts/offsets, per thread
+static size_t* sort_dest;    // new position of each particle
+static size_t sort_dest_alloc;
+
+static inline int particle_destination(Particle* const p, const float_t dx_inv)
+{
+#ifndef FIXED_POSITION
+  if(p->x[0] < 0) p->x[0] += boxsize;
+  else if(p->x[0] >= boxsize) p->x[0] -= boxsize;
+#endif
+
+  const int ix= pos_index(p->x[0], nc, dx_inv);
+
+  if(local_ny == nc)
+    return owner_x[ix];
+
+#ifndef FIXED_POSITION
+  if(p->x[1] < 0) p->x[1] += boxsize;
+  else if(p->x[1] >= boxsize) p->x[1] -= boxsize;
+#endif
+
+  const int iy= pos_index(p->x[1], nc, dx_inv);
+
+  return owner_x[ix] + owner_y[iy];
+}
+
+static inline int particle_column(Particle const * const p,
+				  const float_t dx_inv)
+{
+  // Local PM mesh column index (ix - local_ix0)*local_ny + iy - local_iy0
+  // of the particle
+  int ix= pos_index(p->x[0], nc, dx_inv) - local_ix0;
+  if(ix < 0) ix= 0;
+  else if(ix >= local_nx) ix= local_nx - 1;
+
+  int iy= pos_index(p->x[1], nc, dx_inv) - local_iy0;
+  if(iy < 0) iy= 0;
+  else if(iy >= local_ny) iy= local_ny - 1;
+
+  return ix*local_ny + iy;
+}
+
+void domain_init(const int nc_pm, const float_t boxsize_)
+{
+  // Slab (pencil) decomposition of the PM mesh; node i owns particles with
+  // x plane ix0 <= x/dx < ix0 + nx of its FFT slab, and also
+  // iy0 <= y/dx < iy0 + ny for pencils
+  nc= nc_pm;
+  boxsize= boxsize_;
+  this_node= comm_this_node();
+  n_nodes= comm_n_nodes();
+
+  local_ix0= fft_local_ix0(nc);
+  local_nx= fft_local_nx(nc);
+  local_iy0= fft_local_iy0(nc);
+  local_ny= fft_local_ny(nc);
+
+  owner_x= malloc(sizeof(int)*2*nc); assert(owner_x);
+  owner_y= owner_x + nc;
+  fft_mesh_owners(nc, owner_x, owner_y);
+
+  nsend= malloc(sizeof(int)*4*n_nodes); assert(nsend);
+  nrecv= nsend + n_nodes;
+  send_displ= nrecv + n_nodes;
+  recv_displ= send_displ + n_nodes;
+
+  np_gather= malloc(sizeof(unsigned long)*2*n_nodes); assert(np_gather);
+
+#ifdef _OPENMP
+  const int nthread= omp_get_max_threads();
+#else
+  const int nthread= 1;
+#endif
+  sort_count= malloc(sizeof(size_t)*(nthread*local_nx*local_ny + 1));
+  assert(sort_count);
+
+  MPI_Type_contiguous(sizeof(Particle), MPI_BYTE, &particle_type);
+  MPI_Type_commit(&particle_type);
+
+  msg_printf(msg_verbose, "Domain decomposition initialised\n");
+}
+
+void domain_decompose(Particles* const particles)
+{
+  // Sends particles that left the x-slab (pencil) of this node to their
+  // new owner
+  // Particles are compacted in place; particles->force is not moved
+  // because it is recomputed by pm_compute_forces() after this.
+  Particle* const p= particles->p;
+  const size_t np= particles->np_local;
+  const float_t dx_inv= nc/boxsize;
+
+  for(int i=0; i<n_nodes; i++)
+    nsend[i]= 0;
+
+  for(size_t i=0; i<np; i++)
+    nsend[particle_destination(p + i, dx_inv)]++;
+  nsend[this_node]= 0;
+
+  MPI_Alltoall(nsend, 1, MPI_INT, nrecv, 1, MPI_INT, MPI_COMM_WORLD);
+
+  size_t nsend_total= 0, nrecv_total= 0;
+  for(int i=0; i<n_nodes; i++) {
+    send_displ[i]= nsend_total;
+    recv_displ[i]= nrecv_total;
+    nsend_total += nsend[i];
+    nrecv_total += nrecv[i];
+  }
+
+  const size_t np_new= np - nsend_total + nrecv_total;
+  if(np_new > particles->np_allocated)
+    msg_abort("Error: not enough space for particles after domain "
+	      "decomposition. %lu > %lu allocated\n",
+	      np_new, particles->np_allocated);
+
+  if(nsend_total > nsend_alloc) {
+    nsend_alloc= (size_t)(1.25*nsend_total);
+    buf_send= realloc(buf_send, sizeof(Particle)*nsend_alloc);
+    if(buf_send == 0)
+      msg_abort("Error: unable to allocate %lu particles for domain "
+		"decomposition\n", nsend_alloc);
+  }
+
+  // Pack the leaving particles and compact the staying particles in place
+  for(int i=0; i<n_nodes; i++)
+    nsend[i]= 0;
+
+  size_t np_stay= 0;
+  for(size_t i=0; i<np; i++) {
+    const int node= particle_destination(p + i, dx_inv);
+    if(node == this_node)
+      p[np_stay++]= p[i];
+    else
+      buf_send[send_displ[node] + nsend[node]++]= p[i];
+  }
+  assert(np_stay + nsend_total == np);
+
+  // Received particles go directly after the staying particles
+  MPI_Alltoallv(buf_send, nsend, send_displ, particle_type,
+		p + np_stay, nrecv, recv_displ, particle_type, MPI_COMM_WORLD);
+
+  particles->np_local= np_new;
+
+  // Load imbalance; one collective per step
+  unsigned long nlocal[2]= {np_new, nsend_total};
+  MPI_Gather(nlocal, 2, MPI_UNSIGNED_LONG, np_gather, 2, MPI_UNSIGNED_LONG,
+	     0, MPI_COMM_WORLD);
+
+  if(this_node == 0) {
+    unsigned long np_min= np_gather[0], np_max= np_gather[0];
+    unsigned long np_sum= 0, nmoved= 0;
+    for(int i=0; i<n_nodes; i++) {
+      const unsigned long n= np_gather[2*i];
+      if(n < np_min) np_min= n;
+      if(n > np_max) np_max= n;
+      np_sum += n;
+      nmoved += np_gather[2*i + 1];
+    }
+
+    const double imbalance= np_max/((double) np_sum/n_nodes);
+    msg_printf(imbalance > imbalance_report ? msg_info : msg_verbose,
+	       "Domain decomposition: %lu particles moved; "
+	       "np_local min %lu max %lu, imbalance max/mean= %.3f\n",
+	       nmoved, np_min, np_max, imbalance);
+  }
+}
+
+void domain_sort(Particles* const particles)
+{
+  // Reorders the local particles by PM mesh column (ix, iy) so that the
+  // CIC assignment and the force interpolation access the mesh in order.
+  // Precondition: particles are in the slab (pencil) of this node, after
+  // domain_decompose(). particles->force is not permuted because it is
+  // recomputed by pm_compute_forces() after this.
+  Particle* const p= particles->p;
+  const size_t np= particles->np_local;
+  const float_t dx_inv= nc/boxsize;
+  const int nkey= local_nx*local_ny;
+  const double time0= MPI_Wtime();
+
+  if(np > sort_dest_alloc) {
+    sort_dest_alloc= (size_t)(1.25*np);
+    free(sort_dest);
+    sort_dest= malloc(sizeof(size_t)*sort_dest_alloc);
+    if(sort_dest == 0)
+      msg_abort("Error: unable to allocate sort index for %lu particles\n",
+		sort_dest_alloc);
+  }
+
+  // Parallel counting sort; sort_dest[i] is the new position of p[i]
+#ifdef _OPENMP
+  #pragma omp parallel default(shared)
+#endif
+  {
+#ifdef _OPENMP
+    const int nthread= omp_get_num_threads();
+    size_t* const count= sort_count + omp_get_thread_num()*nkey;
+#else
+    const int nthread= 1;
+    size_t* const count= sort_count;
+#endif
+    for(int k=0; k<nkey; k++)
+      count[k]= 0;
+
+    // Same static schedule for counting and filling
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for(size_t i=0; i<np; i++)
+      count[particle_column(p + i, dx_inv)]++;
+
+#ifdef _OPENMP
+    #pragma omp single
+#endif
+    {
+      size_t n= 0;
+      for(int k=0; k<nkey; k++) {
+	for(int j=0; j<nthread; j++) {
+	  size_t c= sort_count[j*nkey + k];
+	  sort_count[j*nkey + k]= n;
+	  n += c;
+	}
+      }
+      assert(n == np);
+    }
+
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for(size_t i=0; i<np; i++)
+      sort_dest[i]= count[particle_column(p + i, dx_inv)]++;
+  }
+
+  // Apply the permutation in place by following the cycles
+  for(size_t i=0; i<np; i++) {
+    while(sort_dest[i] != i) {
+      const size_t j= sort_dest[i];
+      Particle tmp= p[j];
+      p[j]= p[i];
+      p[i]= tmp;
+
+      sort_dest[i]= sort_dest[j];
+      sort_dest[j]= j;
+    }
+  }
+
+  msg_printf(msg_verbose, "Particles sorted by PM mesh column. %.3f sec\n",
+	     MPI_Wtime() - time0);
+}
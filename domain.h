@@ -0,0 +1,10 @@
+#ifndef DOMAIN_H
+#define DOMAIN_H 1
+
+#include "particle.h"
+
+void domain_init(const int nc_pm, const float_t boxsize);
+void domain_decompose(Particles* const particles);
+void domain_sort(Particles* const particles);
+
+#endif
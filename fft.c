@@ -20,9 +20,407 @@
 #define FFTW(f) fftwf_ ## f
 #endif
 
+#if defined(PENCIL_FFT) && !defined(MPI)
+#error PENCIL_FFT requires MPI
+#endif
+
 
 #ifdef MPI
 
+#ifdef PENCIL_FFT
+//
+// 2-D pencil decomposition on an n1 x n2 process grid; node = r1*n2 + r2
+//   real space:    x split over n1, y over n2, z complete (padded to nzpad)
+//                  index (ix*local_ny + iy)*nzpad + iz
+//   Fourier space: ky split over n1, kz over n2, kx complete
+//                  index (iky*nc + ix)*local_nkz + ikz, the layout of
+//                  FFTW transposed slabs when n2 = 1
+//
+// Forward: r2c along z -> transpose z/y in rows -> FFT along y
+//          -> transpose y/x in columns -> FFT along x; inverse in reverse.
+// The transposes are MPI_Alltoallw with derived datatypes, so no packing;
+// the intermediate [x][y][kz] mesh is in a scratch buffer shared by all
+// FFTs.
+//
+
+typedef struct {
+  FFTW(plan) z_forward, z_inverse;  // r2c/c2r along z, fx <-> fk
+  FFTW(plan) y_forward, y_inverse;  // along y, in scratch [x][y][kz]
+  FFTW(plan) x_forward, x_inverse;  // along x, in fk [ky][x][kz]
+  MPI_Datatype *type_zy, *type_yz;  // transpose in row: fk <-> scratch
+  MPI_Datatype *type_yx, *type_xy;  // transpose in column: scratch <-> fk
+  int *displ_zy, *displ_yz, *displ_yx, *displ_xy; // bytes
+} Pencil;
+
+static int n1, n2, r1, r2;           // process grid and this node
+static MPI_Comm comm_row, comm_col;  // nodes with the same r1 / same r2
+static int* ones;                    // counts for MPI_Alltoallw
+static MPI_Datatype mpi_complex;
+static complex_t* scratch;
+static size_t scratch_size;
+static Mem* scratch_mem;             // Mem of scratch, or 0 for FFTW(malloc)
+
+static void pencil_init(void)
+{
+  if(n1 > 0)
+    return;
+
+  int n_nodes, this_node;
+  MPI_Comm_size(MPI_COMM_WORLD, &n_nodes);
+  MPI_Comm_rank(MPI_COMM_WORLD, &this_node);
+
+  int dims[2]= {0, 0};
+  MPI_Dims_create(n_nodes, 2, dims);
+  n1= dims[0]; n2= dims[1];
+  r1= this_node / n2;
+  r2= this_node % n2;
+
+  MPI_Comm_split(MPI_COMM_WORLD, r1, r2, &comm_row);
+  MPI_Comm_split(MPI_COMM_WORLD, r2, r1, &comm_col);
+
+  ones= malloc(sizeof(int)*(n1 > n2 ? n1 : n2)); assert(ones);
+  for(int i=0; i<(n1 > n2 ? n1 : n2); i++)
+    ones[i]= 1;
+
+  MPI_Type_contiguous(2, FLOAT_TYPE, &mpi_complex);
+  MPI_Type_commit(&mpi_complex);
+
+  msg_printf(msg_info, "Pencil FFT on %d x %d process grid\n", n1, n2);
+}
+
+static inline void block_range(const ptrdiff_t n, const int p, const int r,
+			       ptrdiff_t* const n_local, ptrdiff_t* const i0)
+{
+  // Block r of n elements split into p nearly equal blocks
+  const ptrdiff_t b= n/p, rem= n%p;
+  *n_local= b + (r < rem);
+  *i0= r*b + (r < rem ? r : rem);
+}
+
+static void pencil_local_size(FFT* const fft, const int nc)
+{
+  const ptrdiff_t nckz= nc/2 + 1;
+  block_range(nc, n1, r1, &fft->local_nx, &fft->local_ix0);
+  block_range(nc, n2, r2, &fft->local_ny, &fft->local_iy0);
+  block_range(nc, n1, r1, &fft->local_nky, &fft->local_iky0);
+  block_range(nckz, n2, r2, &fft->local_nkz, &fft->local_ikz0);
+
+  const ptrdiff_t nx_size= fft->local_nx*fft->local_ny*nckz;
+  const ptrdiff_t nk_size= fft->local_nky*nc*fft->local_nkz;
+  fft->ncomplex= nx_size > nk_size ? nx_size : nk_size;
+}
+
+static FFTW(plan) plan_1d(const int nc, const int stride,
+			  const int n_outer, const int stride_outer,
+			  const int n_inner, complex_t* const data,
+			  const int sign)
+{
+  // In-place complex FFT of length nc along stride, for n_outer x n_inner
+  // sequences at stride_outer and 1
+  if(n_outer*n_inner == 0)
+    return 0;
+
+  FFTW(iodim) dim= {nc, stride, stride};
+  FFTW(iodim) howmany[2]= {{n_outer, stride_outer, stride_outer},
+			   {n_inner, 1, 1}};
+  return FFTW(plan_guru_dft)(1, &dim, 2, howmany, data, data, sign,
+			     FFTW_MEASURE);
+}
+
+static void pencil_alloc(FFT* const fft)
+{
+  // Creates the plans and the transpose datatypes
+  const int nc= fft->nc;
+  const int nckz= nc/2 + 1;
+  const int nzpad= 2*nckz;
+  const int nx= fft->local_nx, ny= fft->local_ny;
+  const int nky= fft->local_nky, nkz= fft->local_nkz;
+  const size_t csize= sizeof(complex_t);
+
+  Pencil* const pc= malloc(sizeof(Pencil)); assert(pc);
+  fft->pencil= pc;
+  fft->forward_plan= fft->inverse_plan= 0;
+
+  const size_t size= csize*nx*nc*nkz;
+  if(scratch_mem) {
+    scratch= mem_use_from_zero(scratch_mem, size);
+    scratch_size= scratch_mem->size_alloc;
+  }
+  else if(size > scratch_size) {
+    FFTW(free)(scratch);
+    scratch= FFTW(malloc)(size);
+    if(scratch == 0)
+      msg_abort("Error: unable to allocate pencil FFT scratch, %lu MB\n",
+		mbytes(size));
+    msg_printf(msg_info, "%lu MB allocated for pencil FFT scratch "
+	       "outside Mem\n", mbytes(size));
+    scratch_size= size;
+  }
+
+  // z: real rows (nzpad) <-> complex rows (nckz)
+  pc->z_forward= pc->z_inverse= 0;
+  if(nx*ny > 0) {
+    FFTW(iodim) dim= {nc, 1, 1};
+    FFTW(iodim) howmany= {nx*ny, nzpad, nckz};
+    pc->z_forward= FFTW(plan_guru_dft_r2c)(1, &dim, 1, &howmany,
+					   fft->fx, fft->fk, FFTW_MEASURE);
+    howmany.is= nckz; howmany.os= nzpad;
+    pc->z_inverse= FFTW(plan_guru_dft_c2r)(1, &dim, 1, &howmany,
+					   fft->fk, fft->fx, FFTW_MEASURE);
+  }
+
+  // y: scratch [x][y][kz]
+  pc->y_forward= plan_1d(nc, nkz, nx, nc*nkz, nkz, scratch, FFTW_FORWARD);
+  pc->y_inverse= plan_1d(nc, nkz, nx, nc*nkz, nkz, scratch, FFTW_BACKWARD);
+
+  // x: fk [ky][x][kz]
+  pc->x_forward= plan_1d(nc, nkz, nky, nc*nkz, nkz, fft->fk, FFTW_FORWARD);
+  pc->x_inverse= plan_1d(nc, nkz, nky, nc*nkz, nkz, fft->fk, FFTW_BACKWARD);
+
+  // Transpose z <-> y among the n2 nodes of a row.
+  //   fk [x][y_local(r2)][kz]  block kz_local(s) -> s
+  //   scratch [x][y][kz_local] block y_local(s)  <- s
+  pc->type_zy= malloc(sizeof(MPI_Datatype)*2*n2);
+  pc->displ_zy= malloc(sizeof(int)*2*n2);
+  assert(pc->type_zy && pc->displ_zy);
+  pc->type_yz= pc->type_zy + n2;
+  pc->displ_yz= pc->displ_zy + n2;
+
+  for(int s=0; s<n2; s++) {
+    ptrdiff_t nkz_s, ikz0_s, ny_s, iy0_s;
+    block_range(nckz, n2, s, &nkz_s, &ikz0_s);
+    block_range(nc, n2, s, &ny_s, &iy0_s);
+
+    MPI_Type_vector(nx*ny, nkz_s, nckz, mpi_complex, pc->type_zy + s);
+    pc->displ_zy[s]= csize*ikz0_s;
+
+    MPI_Type_vector(nx, ny_s*nkz, nc*nkz, mpi_complex, pc->type_yz + s);
+    pc->displ_yz[s]= csize*iy0_s*nkz;
+  }
+
+  // Transpose y <-> x among the n1 nodes of a column.
+  //   scratch [x][y][kz]      block ky_local(s) -> s
+  //   fk [ky_local][x][kz]    block x_local(s)  <- s
+  pc->type_yx= malloc(sizeof(MPI_Datatype)*2*n1);
+  pc->displ_yx= malloc(sizeof(int)*2*n1);
+  assert(pc->type_yx && pc->displ_yx);
+  pc->type_xy= pc->type_yx + n1;
+  pc->displ_xy= pc->displ_yx + n1;
+
+  MPI_Datatype plane;
+  MPI_Type_vector(nky, nkz, nc*nkz, mpi_complex, &plane);
+
+  for(int s=0; s<n1; s++) {
+    ptrdiff_t nky_s, iky0_s, nx_s, ix0_s;
+    block_range(nc, n1, s, &nky_s, &iky0_s);
+    block_range(nc, n1, s, &nx_s, &ix0_s);
+
+    MPI_Type_vector(nx, nky_s*nkz, nc*nkz, mpi_complex, pc->type_yx + s);
+    pc->displ_yx[s]= csize*iky0_s*nkz;
+
+    MPI_Type_create_hvector(nx_s, 1, csize*nkz, plane, pc->type_xy + s);
+    pc->displ_xy[s]= csize*ix0_s*nkz;
+  }
+  MPI_Type_free(&plane);
+
+  for(int s=0; s<2*n2; s++)
+    MPI_Type_commit(pc->type_zy + s);
+  for(int s=0; s<2*n1; s++)
+    MPI_Type_commit(pc->type_yx + s);
+}
+
+static void pencil_free(Pencil* const pc)
+{
+  FFTW(plan) plans[]= {pc->z_forward, pc->z_inverse, pc->y_forward,
+		       pc->y_inverse, pc->x_forward, pc->x_inverse};
+  for(int i=0; i<6; i++)
+    if(plans[i]) FFTW(destroy_plan)(plans[i]);
+
+  for(int s=0; s<2*n2; s++)
+    MPI_Type_free(pc->type_zy + s);
+  for(int s=0; s<2*n1; s++)
+    MPI_Type_free(pc->type_yx + s);
+
+  free(pc->type_zy); free(pc->displ_zy);
+  free(pc->type_yx); free(pc->displ_yx);
+  free(pc);
+}
+
+FFT* fft_alloc(const char name[], const int nc, Mem* mem, const int transposed)
+{
+  // Allocates memory for FFT real and Fourier space and initilise plans
+  // Fourier space is always in the transposed layout
+  if(!transposed)
+    msg_abort("Error: pencil FFT supports only transposed layout; %s\n", name);
+
+  pencil_init();
+  FFT* const fft= malloc(sizeof(FFT)); assert(fft);
+  fft->nc= nc;
+  pencil_local_size(fft, nc);
+
+  size_t size= sizeof(complex_t)*fft->ncomplex;
+  if(mem == 0)
+    mem= mem_alloc(name, size);
+
+  void* buf= mem_use_remaining(mem, size);
+  fft->fx= buf; fft->fk= buf;
+
+  pencil_alloc(fft);
+
+  return fft;
+}
+
+FFT* fft_alloc_out_of_place(const char name[], const int nc,
+			    Mem* const mem_x, Mem* const mem_k,
+			    const int transposed)
+{
+  // FFT with real space fx in mem_x and Fourier space fk in mem_k.
+  // The input array of either transform may be overwritten.
+  if(!transposed)
+    msg_abort("Error: pencil FFT supports only transposed layout; %s\n", name);
+
+  pencil_init();
+  FFT* const fft= malloc(sizeof(FFT)); assert(fft);
+  fft->nc= nc;
+  pencil_local_size(fft, nc);
+
+  size_t size= sizeof(complex_t)*fft->ncomplex;
+  fft->fx= mem_use_remaining(mem_x, size);
+  fft->fk= mem_use_remaining(mem_k, size);
+
+  pencil_alloc(fft);
+
+  return fft;
+}
+
+size_t fft_mem_size_working(const int nc, const int transposed)
+{
+  // return the memory size necessary for the 3D FFT
+  if(!transposed)
+    msg_abort("Error: pencil FFT supports only transposed layout\n");
+
+  FFT fft;
+  pencil_init();
+  pencil_local_size(&fft, nc);
+
+  return size_align(sizeof(complex_t)*fft.ncomplex);
+}
+
+size_t fft_mem_size_fk(const int nc, const int transposed)
+{
+  // return the memory size necessary for the 3D FFT data in k space
+  if(!transposed)
+    msg_abort("Error: pencil FFT supports only transposed layout\n");
+
+  FFT fft;
+  pencil_init();
+  pencil_local_size(&fft, nc);
+
+  return size_align(sizeof(complex_t)*nc*fft.local_nky*fft.local_nkz);
+}
+
+size_t fft_mem_size_scratch(const int nc)
+{
+  // return the memory size of the transpose scratch shared by pencil FFTs
+  FFT fft;
+  pencil_init();
+  pencil_local_size(&fft, nc);
+
+  return size_align(sizeof(complex_t)*fft.local_nx*nc*fft.local_nkz);
+}
+
+void fft_set_scratch(Mem* const mem)
+{
+  // Pencil FFTs use mem for the transpose scratch; call before the first
+  // fft_alloc with mem of fft_mem_size_scratch() of the largest nc.
+  // Without it the scratch is allocated outside Mem.
+  if(scratch)
+    msg_abort("Error: fft_set_scratch() after the first pencil FFT\n");
+  scratch_mem= mem;
+}
+
+size_t fft_local_nx(const int nc)
+{
+  FFT fft;
+  pencil_init();
+  pencil_local_size(&fft, nc);
+  return fft.local_nx;
+}
+
+size_t fft_local_ix0(const int nc)
+{
+  FFT fft;
+  pencil_init();
+  pencil_local_size(&fft, nc);
+  return fft.local_ix0;
+}
+
+size_t fft_local_ny(const int nc)
+{
+  FFT fft;
+  pencil_init();
+  pencil_local_size(&fft, nc);
+  return fft.local_ny;
+}
+
+size_t fft_local_iy0(const int nc)
+{
+  FFT fft;
+  pencil_init();
+  pencil_local_size(&fft, nc);
+  return fft.local_iy0;
+}
+
+void fft_finalize(void)
+{
+  if(scratch_mem == 0)
+    FFTW(free)(scratch);
+  scratch= 0; scratch_size= 0;
+}
+
+void fft_execute_forward(FFT* const fft)
+{
+  Pencil* const pc= fft->pencil;
+
+  if(pc->z_forward)
+    FFTW(execute_dft_r2c)(pc->z_forward, fft->fx, fft->fk);
+
+  MPI_Alltoallw(fft->fk, ones, pc->displ_zy, pc->type_zy,
+		scratch, ones, pc->displ_yz, pc->type_yz, comm_row);
+
+  if(pc->y_forward)
+    FFTW(execute_dft)(pc->y_forward, scratch, scratch);
+
+  MPI_Alltoallw(scratch, ones, pc->displ_yx, pc->type_yx,
+		fft->fk, ones, pc->displ_xy, pc->type_xy, comm_col);
+
+  if(pc->x_forward)
+    FFTW(execute_dft)(pc->x_forward, fft->fk, fft->fk);
+}
+
+void fft_execute_inverse(FFT* const fft)
+{
+  Pencil* const pc= fft->pencil;
+
+  if(pc->x_inverse)
+    FFTW(execute_dft)(pc->x_inverse, fft->fk, fft->fk);
+
+  MPI_Alltoallw(fft->fk, ones, pc->displ_xy, pc->type_xy,
+		scratch, ones, pc->displ_yx, pc->type_yx, comm_col);
+
+  if(pc->y_inverse)
+    FFTW(execute_dft)(pc->y_inverse, scratch, scratch);
+
+  MPI_Alltoallw(scratch, ones, pc->displ_yz, pc->type_yz,
+		fft->fk, ones, pc->displ_zy, pc->type_zy, comm_row);
+
+  if(pc->z_inverse)
+    FFTW(execute_dft_c2r)(pc->z_inverse, fft->fk, fft->fx);
+}
+
+#else
+// FFTW-MPI slab decomposition
+
 FFT* fft_alloc(const char name[], const int nc, Mem* mem, const int transposed)
 {
   // Allocates memory for FFT real and Fourier space and initilise fftw_plans
@@ -45,6 +443,9 @@ FFT* fft_alloc(const char name[], const int nc, Mem* mem, const int transposed)
 			    &fft->local_nx, &fft->local_ix0);
     fft->local_nky= fft->local_iky0= 0;
   }
+  fft->local_ny= nc; fft->local_iy0= 0;
+  fft->local_nkz= nc/2 + 1; fft->local_ikz0= 0;
+  fft->pencil= 0;
 
   size_t size= sizeof(complex_t)*ncomplex;
   assert(fft->local_nx >= 0); assert(fft->local_ix0 >= 0);
@@ -79,6 +480,52 @@ FFT* fft_alloc(const char name[], const int nc, Mem* mem, const int transposed)
   return fft;
 }
 
+FFT* fft_alloc_out_of_place(const char name[], const int nc,
+			    Mem* const mem_x, Mem* const mem_k,
+			    const int transposed)
+{
+  // FFT with real space fx in mem_x and Fourier space fk in mem_k.
+  // The input array of either transform may be overwritten.
+  // Call mem_use_from_zero(mem, 0) before this to use mem from the beginning.
+  FFT* const fft= malloc(sizeof(FFT)); assert(fft);
+  fft->nc= nc;
+
+  ptrdiff_t ncomplex= 0;
+  if(transposed) {
+    ncomplex= FFTW(mpi_local_size_3d_transposed)(nc, nc, nc, MPI_COMM_WORLD,
+	                 &fft->local_nx, &fft->local_ix0,
+			 &fft->local_nky, &fft->local_iky0);
+  }
+  else {
+    ncomplex= FFTW(mpi_local_size_3d)(nc, nc, nc, MPI_COMM_WORLD,
+			    &fft->local_nx, &fft->local_ix0);
+    fft->local_nky= fft->local_iky0= 0;
+  }
+  fft->local_ny= nc; fft->local_iy0= 0;
+  fft->local_nkz= nc/2 + 1; fft->local_ikz0= 0;
+  fft->pencil= 0;
+
+  size_t size= sizeof(complex_t)*ncomplex;
+  assert(fft->local_nx >= 0); assert(fft->local_ix0 >= 0);
+
+  fft->ncomplex= ncomplex;
+  fft->fx= mem_use_remaining(mem_x, size);
+  fft->fk= mem_use_remaining(mem_k, size);
+
+  unsigned flag= 0, flag_inv= 0;
+  if(transposed) {
+    flag= FFTW_MPI_TRANSPOSED_OUT;
+    flag_inv= FFTW_MPI_TRANSPOSED_IN;
+  }
+
+  fft->forward_plan= FFTW(mpi_plan_dft_r2c_3d)(nc, nc, nc, fft->fx, fft->fk,
+				       MPI_COMM_WORLD, FFTW_MEASURE | flag);
+  fft->inverse_plan= FFTW(mpi_plan_dft_c2r_3d)(nc, nc, nc, fft->fk, fft->fx,
+                                     MPI_COMM_WORLD, FFTW_MEASURE | flag_inv);
+
+  return fft;
+}
+
 size_t fft_mem_size_working(const int nc, const int transposed)
 {
   // return the memory size necessary for the 3D FFT
@@ -128,6 +575,23 @@ size_t fft_local_nx(const int nc)
   return local_nx;
 }
 
+size_t fft_local_ix0(const int nc)
+{
+  ptrdiff_t local_nx, local_ix0; 
+  FFTW(mpi_local_size_3d)(nc, nc, nc, MPI_COMM_WORLD, &local_nx, &local_ix0);
+
+  return local_ix0;
+}
+
+size_t fft_local_ny(const int nc)
+{
+  return nc;
+}
+
+size_t fft_local_iy0(const int nc)
+{
+  return 0;
+}
 
 void fft_finalize(void)
 {
@@ -144,6 +608,36 @@ void fft_execute_inverse(FFT* const fft)
   FFTW(mpi_execute_dft_c2r)(fft->inverse_plan, fft->fk, fft->fx);
 }
 
+#endif // PENCIL_FFT
+
+void fft_mesh_owners(const int nc, int* const owner_x, int* const owner_y)
+{
+  // The node owning real-space mesh point (ix, iy) is
+  // owner_x[ix] + owner_y[iy], for both slab and pencil decompositions
+  int n_nodes;
+  MPI_Comm_size(MPI_COMM_WORLD, &n_nodes);
+
+  const int local[]= {fft_local_ix0(nc), fft_local_nx(nc),
+		      fft_local_iy0(nc), fft_local_ny(nc)};
+  int* const range= malloc(sizeof(int)*4*n_nodes); assert(range);
+
+  MPI_Allgather(local, 4, MPI_INT, range, 4, MPI_INT, MPI_COMM_WORLD);
+
+  for(int i=0; i<n_nodes; i++) {
+    const int* const r= range + 4*i;
+    if(r[1] == 0 || r[3] == 0) continue;
+
+    if(r[2] == 0)
+      for(int ix=r[0]; ix<r[0] + r[1]; ix++)
+	owner_x[ix]= i;
+    if(r[0] == 0)
+      for(int iy=r[2]; iy<r[2] + r[3]; iy++)
+	owner_y[iy]= i;
+  }
+
+  free(range);
+}
+
 
 #else
 // Serial version
@@ -154,6 +648,11 @@ FFT* fft_alloc(const char name[], const int nc, Mem* mem, unsigned flags)
   fft->nc= nc;
   fft->local_nx= nc;
   fft->local_ix0= 0;
+  fft->local_ny= nc;
+  fft->local_iy0= 0;
+  fft->local_nkz= nc/2 + 1;
+  fft->local_ikz0= 0;
+  fft->pencil= 0;
 
   const size_t nckz= nc/2 + 1;
   ptrdiff_t ncomplex= nc*nc*nckz;
@@ -179,6 +678,35 @@ FFT* fft_alloc(const char name[], const int nc, Mem* mem, unsigned flags)
   return fft;
 }
 
+FFT* fft_alloc_out_of_place(const char name[], const int nc,
+			    Mem* const mem_x, Mem* const mem_k, unsigned flags)
+{
+  FFT* const fft= malloc(sizeof(FFT)); assert(fft);
+  fft->nc= nc;
+  fft->local_nx= nc;
+  fft->local_ix0= 0;
+  fft->local_ny= nc;
+  fft->local_iy0= 0;
+  fft->local_nkz= nc/2 + 1;
+  fft->local_ikz0= 0;
+  fft->pencil= 0;
+
+  const size_t nckz= nc/2 + 1;
+  ptrdiff_t ncomplex= nc*nc*nckz;
+  size_t size= sizeof(complex_t)*ncomplex;
+
+  fft->ncomplex= ncomplex;
+  fft->fx= mem_use_remaining(mem_x, size);
+  fft->fk= mem_use_remaining(mem_k, size);
+
+  fft->forward_plan= FFTW(plan_dft_r2c_3d)(nc, nc, nc, fft->fx, fft->fk,
+					   FFTW_ESTIMATE | flags);
+  fft->inverse_plan= FFTW(plan_dft_c2r_3d)(nc, nc, nc, fft->fk, fft->fx,
+					   FFTW_ESTIMATE | flags);
+
+  return fft;
+}
+
 void fft_finalize(void)
 {
   FFTW(cleanup)();
@@ -198,10 +726,26 @@ void fft_execute_inverse(FFT* const fft)
 
 // No change whehter with or without MPI
 
+#ifndef PENCIL_FFT
+size_t fft_mem_size_scratch(const int nc)
+{
+  // slab and serial FFTs transform without scratch
+  return 0;
+}
+
+void fft_set_scratch(Mem* const mem)
+{
+}
+#endif
+
 void fft_free(FFT* const fft)
 {
+#ifdef PENCIL_FFT
+  pencil_free(fft->pencil);
+#else
   FFTW(destroy_plan)(fft->forward_plan);
   FFTW(destroy_plan)(fft->inverse_plan);
+#endif
   
   if(fft->allocated == true) {
     free(fft->fx);
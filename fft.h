@@ -12,16 +12,26 @@ typedef struct {
   complex_t*  fk;
   ptrdiff_t   local_nx, local_ix0;
   ptrdiff_t   local_nky, local_iky0;
+  ptrdiff_t   local_ny, local_iy0;   // real-space y rows; nc for slabs
+  ptrdiff_t   local_nkz, local_ikz0; // Fourier-space z range; nc/2+1 for slabs
   fftwf_plan  forward_plan, inverse_plan;
   ptrdiff_t   ncomplex;
   bool        allocated;
+  void*       pencil;                // plans for PENCIL_FFT
 } FFT;
 
 size_t fft_mem_size_working(const int nc, const int transposed);
 size_t fft_mem_size_fk(const int nc, const int transposed);
+size_t fft_mem_size_scratch(const int nc);
+void fft_set_scratch(Mem* const mem);
 size_t fft_local_nx(const int nc);
+size_t fft_local_ix0(const int nc);
+size_t fft_local_ny(const int nc);
+size_t fft_local_iy0(const int nc);
+void fft_mesh_owners(const int nc, int* const owner_x, int* const owner_y);
   
 FFT* fft_alloc(const char name[], const int nc, Mem* mem, const int transposed);
+FFT* fft_alloc_out_of_place(const char name[], const int nc, Mem* const mem_x, Mem* const mem_k, const int transposed);
 void fft_execute_forward(FFT* const fft);
 void fft_execute_inverse(FFT* const fft);
 void fft_free(FFT* const fft);
@@ -2,7 +2,6 @@
 #include <assert.h>
 #include <mpi.h>
 
-#include <gsl/gsl_integration.h>
 #include <gsl/gsl_roots.h>
 #include <gsl/gsl_sf_hyperg.h> 
 #include <gsl/gsl_errno.h>
@@ -31,20 +30,25 @@ void leapfrog_set_initial_velocities(Particles* const particles)
   //const float Dv_test=DprimeQ(a, 1.0, da1); // dD_{za}/dy
   //const float Dv2_test=growthD2v(a, da2);   // dD_{2lpt}/dy
 
-  const float Dv= cosmology_Dv_growth(a, da1);
-  const float D2v= cosmology_D2v_growth(a, da2);
+  float Dv[3], D2v[3];
+  for(int k=0; k<3; k++) {
+    Dv[k]= cosmology_Dv_growth(a, da1)*particles->dx1_unit[k];
+    D2v[k]= cosmology_D2v_growth(a, da2)*particles->dx2_unit[k];
+  }
 
   //fprintf(stderr, "test %e %e %e %e\n", Dv, Dv_test, D2v, Dv2_test);
   // debug !!!!
+  // added to the 3LPT velocity set by lpt_set_displacements (0 for 2LPT)
   for(int i=0; i<np; i++) {
-    p[i].v[0]= p[i].dx1[0]*Dv + p[i].dx2[0]*D2v;
-    p[i].v[1]= p[i].dx1[1]*Dv + p[i].dx2[1]*D2v;
-    p[i].v[2]= p[i].dx1[2]*Dv + p[i].dx2[2]*D2v;
+    p[i].v[0] += p[i].dx1[0]*Dv[0] + p[i].dx2[0]*D2v[0];
+    p[i].v[1] += p[i].dx1[1]*Dv[1] + p[i].dx2[1]*D2v[1];
+    p[i].v[2] += p[i].dx1[2]*Dv[2] + p[i].dx2[2]*D2v[2];
   }
 
 
   msg_printf(msg_info, "Leapfrog (non-cola) initial velocity set at a= %.3f\n", a);
-  msg_printf(msg_debug, "Dv= %e, Dv2= %e\n", Dv, D2v);
+  msg_printf(msg_debug, "Dv= %e, Dv2= %e\n",
+	     cosmology_Dv_growth(a, da1), cosmology_D2v_growth(a, da2));
 }
 
 void leapfrog_kick(Particles* const particles, const double avel1)
@@ -85,6 +89,7 @@ void leapfrog_drift(Particles* const particles, const double apos1)
   
   Particle* const p= particles->p;
   const size_t np= particles->np_local;
+  const float_t boxsize= particles->boxsize;
 
   const double dt=SqStd(ai, af);
 
@@ -96,57 +101,22 @@ void leapfrog_drift(Particles* const particles, const double apos1)
   #pragma omp parallel for default(shared)
 #endif
   for(int i=0; i<np; i++) {
-    p[i].x[0] += p[i].v[0]*dt;
-    p[i].x[1] += p[i].v[1]*dt;
-    p[i].x[2] += p[i].v[2]*dt;
+    p[i].x[0]= pos_add(p[i].x[0], p[i].v[0]*dt, boxsize);
+    p[i].x[1]= pos_add(p[i].x[1], p[i].v[1]*dt, boxsize);
+    p[i].x[2]= pos_add(p[i].x[2], p[i].v[2]*dt, boxsize);
   }
     
   particles->a_x= af;
 }
 
-static double funSphiStd (double a, void * params)
-{
-  return 1.0/(sqrt(Om/(a*a*a) + 1.0 - Om)*a*a);
-}
-
 static double SphiStd(double ai, double af)
 {
-  gsl_integration_workspace * w 
-    = gsl_integration_workspace_alloc(5000);
-       
-  double result, error;
-     
-  gsl_function F;
-  F.function= &funSphiStd;
-  F.params = 0;
-  
-  gsl_integration_qag(&F, ai, af, 0, 1e-5, 5000, 6,
-		      w, &result, &error); 
-  
-  gsl_integration_workspace_free(w);
-     
-  return result;
-}
-
-static double funSqStd (double a, void * params)
-{       
-  return 1.0/(sqrt(Om/(a*a*a) + 1.0 - Om)*a*a*a);
+  // \int_ai^af da/(a^2 H(a))
+  return cosmology_kick_integral(ai, af);
 }
      
 static double SqStd(double ai, double af)
 {
-  gsl_integration_workspace * w 
-    = gsl_integration_workspace_alloc(5000);
-       
-  double result, error;
-     
-  gsl_function F;
-  F.function= &funSqStd;
-  F.params= 0;
-     
-  gsl_integration_qag(&F, ai, af, 0, 1e-5, 5000, 6, w, &result, &error);      
-  gsl_integration_workspace_free(w);
-  
-  return result;
+  // \int_ai^af da/(a^3 H(a))
+  return cosmology_drift_integral(ai, af, 0.0);
 }
-
@@ -6,9 +6,11 @@
 ///
 
 #include <math.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <gsl/gsl_rng.h>
 #include "msg.h"
+#include "comm.h"
 #include "mem.h"
 #include "config.h"
 #include "cosmology.h"
@@ -19,13 +21,21 @@
 
 static unsigned int* seedtable;
 static double boxsize;
+static enum LptRandom random_mode= lpt_random_ngenic;
+static bool low_memory; // 2LPT with 3 meshes instead of 9
+static bool low_memory_request= false; // lpt_set_low_memory()
+static int lpt_order= 2;
+static bool fixed_amplitude= false; // |delta_k|^2 = P(k) without scatter
+static double phase_shift= 0.0;     // pi for the phase-flipped pair
 
 //static int ix0= Local_x_start
 //static int nx -- Local_nx
 
 static size_t nc;
-static size_t local_nx;
-static size_t local_ix0;
+static size_t local_nx, local_ix0;   // real space x planes
+static size_t local_ny, local_iy0;   // real space y rows
+static size_t local_nky, local_iky0; // Fourier space ky
+static size_t local_nkz, local_ikz0; // Fourier space kz
 
 FFT* fft_psi[3];    // Zeldovichi displacement Psi_i
 FFT* fft_psi_ij[6]; // derivative Psi_i,j= dPsi_i/dq_j
@@ -37,6 +47,57 @@ static void set_seedtable(const int nc, gsl_rng* random_generator,
 			  unsigned int* const stable);
 static void lpt_generate_psi_k(const unsigned long seed, PowerSpectrum* const);
 static void lpt_compute_psi2_k(void);
+static void lpt_generate_phi_k(const unsigned long seed, PowerSpectrum* const);
+static void set_displacements_low_memory(const unsigned long seed,
+					 PowerSpectrum* const ps,
+					 const double a, Particles* particles);
+static void generate_modes_philox(const unsigned long seed,
+				  PowerSpectrum* const ps,
+				  complex_t* const phi_k, complex_t* psi_k[]);
+static void lpt_compute_psi3b_source(void);
+static float_t displacement_unit(float_t const * const f, const double fac);
+static void add_third_order(const double a, Particles* const particles);
+
+static inline pos_t lattice_pos(const size_t q, const float_t offset,
+				const float_t dx)
+{
+  // Lagrangian position (q + offset)*dx
+#ifdef FIXED_POSITION
+  return pos_add(0, (q + offset)*(boxsize/nc), boxsize);
+#else
+  return (q + offset)*dx;
+#endif
+}
+
+static inline long k_index(const size_t ix, const size_t iy, const size_t iz)
+{
+  // Index of mode (ix, iy, iz) in the transposed Fourier-space layout
+  // [iy - local_iky0][ix][iz - local_ikz0], or -1 if not on this node
+  if(iy < local_iky0 || iy >= local_iky0 + local_nky ||
+     iz < local_ikz0 || iz >= local_ikz0 + local_nkz)
+    return -1;
+
+  return ((iy - local_iky0)*nc + ix)*local_nkz + (iz - local_ikz0);
+}
+
+static inline double mode_power(const double ampl)
+{
+  // |delta_k|^2/P(k): exponentially distributed (Rayleigh amplitude) from
+  // the uniform random number ampl, or 1 for fixed-amplitude modes. The
+  // random number is drawn either way, keeping the sequence.
+  return fixed_amplitude ? 1.0 : -log(ampl);
+}
+
+static inline size_t k2_index(const size_t ix, const size_t iy, const size_t iz)
+{
+  // |k|^2 of mode (ix, iy, iz) in units of (2pi/boxsize)^2; the key of
+  // power_spectrum_k2
+  const long jx= ix < nc/2 ? (long) ix : (long) ix - (long) nc;
+  const long jy= iy < nc/2 ? (long) iy : (long) iy - (long) nc;
+  const long jz= iz < nc/2 ? (long) iz : (long) iz - (long) nc;
+
+  return (size_t)(jx*jx + jy*jy + jz*jz);
+}
 
 void lpt_init(const int nc_, const double boxsize_, Mem* mem)
 {
@@ -44,6 +105,11 @@ void lpt_init(const int nc_, const double boxsize_, Mem* mem)
   nc= nc_;
 
   msg_printf(msg_debug, "lpt_init(nc= %d, boxsize= %.1lf)\n", nc, boxsize);
+
+#ifdef PACKED_ID
+  if((uint64_t) nc*nc*nc > UINT32_MAX)
+    msg_abort("Error: nc= %d too large for 32-bit PACKED_ID\n", nc);
+#endif
   
   //if(mem == 0)
   //  mem= mem_init("mem_lpt");
@@ -51,11 +117,29 @@ void lpt_init(const int nc_, const double boxsize_, Mem* mem)
   if(mem != NULL)
     mem_use_from_zero(mem, 0);
   
+  // Fourier space in the transposed layout [ky][kx][kz], which is also
+  // the layout of the pencil decomposition
   for(int i=0; i<3; i++)
-    fft_psi[i]= fft_alloc("Psi_i", nc, mem, 0);
+    fft_psi[i]= fft_alloc("Psi_i", nc, mem, 1);
+
+  // 9 meshes hold all Psi_i,j at once; in low-memory mode, the derivatives
+  // are computed one at a time in 3 meshes
+  low_memory= low_memory_request;
+  if(!low_memory && mem && mem->size_alloc < 9*fft_mem_size_working(nc, 1)) {
+    msg_printf(msg_warn, "Not enough memory for 9 LPT meshes; "
+	       "use lpt_set_low_memory() and reserve 3\n");
+    low_memory= true;
+  }
 
-  for(int i=0; i<6; i++)
-    fft_psi_ij[i]= fft_alloc("Psi_ij", nc, mem, 0);
+  if(low_memory) {
+    msg_printf(msg_info, "Low-memory 2LPT with 3 FFT meshes\n");
+    for(int i=0; i<6; i++)
+      fft_psi_ij[i]= 0;
+  }
+  else {
+    for(int i=0; i<6; i++)
+      fft_psi_ij[i]= fft_alloc("Psi_ij", nc, mem, 1);
+  }
 
   for(int i=0; i<3; i++)
     fft_psi2[i]= fft_psi_ij[i];
@@ -67,19 +151,60 @@ void lpt_init(const int nc_, const double boxsize_, Mem* mem)
   // checks
   local_nx= fft_psi[0]->local_nx;
   local_ix0= fft_psi[0]->local_ix0;
+  local_ny= fft_psi[0]->local_ny;
+  local_iy0= fft_psi[0]->local_iy0;
+  local_nky= fft_psi[0]->local_nky;
+  local_iky0= fft_psi[0]->local_iky0;
+  local_nkz= fft_psi[0]->local_nkz;
+  local_ikz0= fft_psi[0]->local_ikz0;
   
   for(int i=0; i<3; i++) {
     assert(fft_psi[i]->nc == nc);
     assert(fft_psi[i]->local_nx == local_nx);
     assert(fft_psi[i]->local_ix0 == local_ix0);
+    assert(fft_psi[i]->local_nky == local_nky);
   }
-  for(int i=0; i<6; i++) {
+  for(int i=0; i<6 && !low_memory; i++) {
     assert(fft_psi_ij[i]->nc == nc);
     assert(fft_psi_ij[i]->local_nx == local_nx);
     assert(fft_psi_ij[i]->local_ix0 == local_ix0);
+    assert(fft_psi_ij[i]->local_nky == local_nky);
   }
 }
 
+void lpt_set_low_memory(const bool low)
+{
+  // 2LPT with 3 FFT meshes instead of 9, at the cost of more FFTs;
+  // call before lpt_init(). 3LPT needs all 9.
+  low_memory_request= low;
+}
+
+void lpt_set_order(const int order)
+{
+  // 2: 2LPT (default)
+  // 3: 3LPT added to the initial positions and velocities; dx1 and dx2
+  //    remain the 1st- and 2nd-order displacements for COLA
+  if(order != 2 && order != 3)
+    msg_abort("Error: LPT order must be 2 or 3: %d\n", order);
+
+  lpt_order= order;
+}
+
+void lpt_set_fixed_paired(const bool fixed, const bool paired)
+{
+  // fixed:  |delta_k| = sqrt(P(k)) with random phases
+  // paired: phases shifted by pi, delta_k -> -delta_k, for the same seed
+  fixed_amplitude= fixed;
+  phase_shift= paired ? M_PI : 0.0;
+}
+
+void lpt_set_random(const enum LptRandom mode)
+{
+  // lpt_random_ngenic:  N-GenIC compatible random phases (default)
+  // lpt_random_philox:  counter-based Philox4x32-10 random numbers
+  random_mode= mode;
+}
+
 void set_seedtable(const int nc, gsl_rng* random_generator,
 		   unsigned int* const stable)
 {
@@ -123,17 +248,32 @@ void set_seedtable(const int nc, gsl_rng* random_generator,
 FFT* lpt_generate_phi(const unsigned long seed, PowerSpectrum* const ps)
 {
   // Generates linear potential field
+  lpt_generate_phi_k(seed, ps);
+
+  fft_execute_inverse(fft_psi[0]);
+  return fft_psi[0];
+}
+
+void lpt_generate_phi_k(const unsigned long seed, PowerSpectrum* const ps)
+{
+  // Generates linear potential phi_k = -delta_k/k^2 in fft_psi[0]->fk
   msg_printf(msg_verbose, "Generating phi_k...\n");
 
   assert(fft_psi[0]);
 
   complex_t* phi_k= fft_psi[0]->fk;
 
-  const size_t nckz= nc/2 + 1;
   const double dk= 2.0*M_PI/boxsize;
   const double knq= nc*M_PI/boxsize; // Nyquist frequency
   const double fac= pow(2*M_PI/boxsize, 1.5);
   const double fac_2pi3= 1.0/(8.0*M_PI*M_PI*M_PI);
+
+  power_tabulate(ps, nc, boxsize);
+
+  if(random_mode == lpt_random_philox) {
+    generate_modes_philox(seed, ps, phi_k, 0);
+    return;
+  }
   
   gsl_rng* random_generator = gsl_rng_alloc(gsl_rng_ranlxd1);
   gsl_rng_set(random_generator, seed);
@@ -141,140 +281,151 @@ FFT* lpt_generate_phi(const unsigned long seed, PowerSpectrum* const ps)
 
   
   // clean the delta_k grid
-  for(size_t ix=0; ix<local_nx; ix++)
-   for(size_t iy=0; iy<nc; iy++)
-    for(size_t iz=0; iz<nckz; iz++)
-      for(int i=0; i<3; i++) {
-	size_t index= (ix*nc + iy)*nckz + iz;
-	phi_k[index][0] = 0;
-	phi_k[index][1] = 0;
-      }
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy=0; iy<local_nky; iy++)
+   for(size_t ix=0; ix<nc; ix++)
+    for(size_t iz=0; iz<local_nkz; iz++) {
+      size_t index= (iy*nc + ix)*local_nkz + iz;
+      phi_k[index][0] = 0;
+      phi_k[index][1] = 0;
+    }
 
-  double kvec[3];
-  for(size_t ix=0; ix<nc; ix++) {
-    size_t iix = nc - ix;
-    if(iix == nc)
-      iix = 0;
-
-    if(!((local_ix0 <= ix  && ix  < (local_ix0 + local_nx)) ||
-	 (local_ix0 <= iix && iix < (local_ix0 + local_nx))))
-      continue;
-    
-    for(size_t iy=0; iy<nc; iy++) {
-      gsl_rng_set(random_generator, seedtable[ix*nc + iy]);
-      
-      for(size_t iz=0; iz<nc/2; iz++) {
-	double phase= gsl_rng_uniform(random_generator)*2*M_PI;
-	double ampl;
-	do
-	  ampl = gsl_rng_uniform(random_generator);
-	while(ampl == 0.0);
-
-	if(ix == nc/2 || iy == nc/2 || iz == nc/2)
-	  continue;
-	if(ix == 0 && iy == 0 && iz == 0)
+  gsl_rng_free(random_generator);
+
+  // Modes are distributed in ky (and kz for pencils); every node follows
+  // the same random sequence per (ix, iy) column and keeps its own modes
+#ifdef _OPENMP
+  #pragma omp parallel default(shared)
+#endif
+  {
+    // one generator per thread, reseeded for each column
+    gsl_rng* random_generator = gsl_rng_alloc(gsl_rng_ranlxd1);
+    double kvec[3];
+
+#ifdef _OPENMP
+    #pragma omp for
+#endif
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iy=0; iy<nc; iy++) {
+	size_t iiy = nc - iy;
+	if(iiy == nc)
+	  iiy = 0;
+
+	if(!((local_iky0 <= iy  && iy  < (local_iky0 + local_nky)) ||
+	     (local_iky0 <= iiy && iiy < (local_iky0 + local_nky))))
 	  continue;
+
+	gsl_rng_set(random_generator, seedtable[ix*nc + iy]);
+      
+	for(size_t iz=0; iz<nc/2; iz++) {
+	  double phase= gsl_rng_uniform(random_generator)*2*M_PI + phase_shift;
+	  double ampl;
+	  do
+	    ampl = gsl_rng_uniform(random_generator);
+	  while(ampl == 0.0);
+
+	  if(ix == nc/2 || iy == nc/2 || iz == nc/2)
+	    continue;
+	  if(ix == 0 && iy == 0 && iz == 0)
+	    continue;
 	
-	if(ix < nc/2)
-	  kvec[0]= dk*ix;
-	else
-	  kvec[0]= -dk*(nc - ix);
+	  if(ix < nc/2)
+	    kvec[0]= dk*ix;
+	  else
+	    kvec[0]= -dk*(nc - ix);
 	
-	if(iy < nc/2)
-	  kvec[1]= dk*iy;
-	else
-	  kvec[1]= -dk*(nc - iy);
+	  if(iy < nc/2)
+	    kvec[1]= dk*iy;
+	  else
+	    kvec[1]= -dk*(nc - iy);
 	
-	if(iz < nc/2)
-	  kvec[2]= dk*iz;
-	else
-	  kvec[2]= -dk*(nc - iz);
+	  if(iz < nc/2)
+	    kvec[2]= dk*iz;
+	  else
+	    kvec[2]= -dk*(nc - iz);
 	
-	double kmag2 = kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2];
-	double kmag = sqrt(kmag2);
+	  double kmag2 = kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2];
 	
 #ifdef SPHEREMODE
-	// select a sphere in k-space
-	if(kmag > knq)
-	  continue;
+	  // select a sphere in k-space
+	  if(kmag2 > knq*knq)
+	    continue;
 #else
-	if(fabs(kvec[0]) > knq)
-	  continue;
-	if(fabs(kvec[1]) > knq)
-	  continue;
-	if(fabs(kvec[2]) > knq)
-	  continue;
+	  if(fabs(kvec[0]) > knq)
+	    continue;
+	  if(fabs(kvec[1]) > knq)
+	    continue;
+	  if(fabs(kvec[2]) > knq)
+	    continue;
 #endif
 	
-	//double p_of_k = PowerSpec(kmag); // = 1/(2pi)^3*P(k)
-	//double pk= fac_2pi3*power_spectrum(ps, kmag);	
-	//p_of_k *= -log(ampl);
+	  //double p_of_k = PowerSpec(kmag); // = 1/(2pi)^3*P(k)
+	  //double pk= fac_2pi3*power_spectrum(ps, kmag);	
+	  //p_of_k *= -log(ampl);
 
-	double delta2= -log(ampl)*fac_2pi3*power_spectrum(ps, kmag);
+	  double delta2= mode_power(ampl)*fac_2pi3*
+			   power_spectrum_k2(ps, k2_index(ix, iy, iz));
 	
-	double delta_k_mag= fac*sqrt(delta2);
-	// delta_k_mag -- |delta_k| extrapolated to a=1
-	// Displacement is extrapolated to a=1
-
-	if(iz > 0) {
-	  if(local_ix0 <= ix && ix < (local_ix0 + local_nx)) {
-	    size_t index= ((ix - local_ix0)*nc + iy)*nckz + iz;
-	     phi_k[index][0]= -delta_k_mag*cos(phase)/kmag2;
-	     phi_k[index][1]= -delta_k_mag*sin(phase)/kmag2;
+	  double delta_k_mag= fac*sqrt(delta2);
+	  // delta_k_mag -- |delta_k| extrapolated to a=1
+	  // Displacement is extrapolated to a=1
+
+	  if(iz > 0) {
+	    long index= k_index(ix, iy, iz);
+	    if(index >= 0) {
+	       phi_k[index][0]= -delta_k_mag*cos(phase)/kmag2;
+	       phi_k[index][1]= -delta_k_mag*sin(phase)/kmag2;
+	    }
 	  }
-	}
-	else { // k=0 plane needs special treatment
-	  if(ix == 0) {
-	    if(iy >= nc/2)
-	      continue;
-	    else {
-	      if(local_ix0 <= ix && ix < (local_ix0 + local_nx)) {
-		size_t iiy= nc - iy; // note: j!=0 surely holds at this point
-		size_t index= ((ix - local_ix0)*nc + iy)*nckz + iz;				size_t iindex= ((ix - local_ix0)*nc + iiy)*nckz + iz;
+	  else { // k=0 plane needs special treatment
+	    if(ix == 0) {
+	      if(iy >= nc/2)
+		continue;
+	      else {
+		// note: j!=0 surely holds at this point
+		long index= k_index(ix, iy, iz);
+		long iindex= k_index(ix, iiy, iz);
 		
-		phi_k[index][0]=  -delta_k_mag*cos(phase)/kmag2;
-		phi_k[index][1]=  -delta_k_mag*sin(phase)/kmag2;
-
-		phi_k[iindex][0]= -delta_k_mag*cos(phase)/kmag2;
-		phi_k[iindex][1]=  delta_k_mag*sin(phase)/kmag2;
-
-
+		if(index >= 0) {
+		  phi_k[index][0]=  -delta_k_mag*cos(phase)/kmag2;
+		  phi_k[index][1]=  -delta_k_mag*sin(phase)/kmag2;
+		}
+		if(iindex >= 0) {
+		  phi_k[iindex][0]= -delta_k_mag*cos(phase)/kmag2;
+		  phi_k[iindex][1]=  delta_k_mag*sin(phase)/kmag2;
+		}
 	      }
 	    }
-	  }
-	  else { // here comes i!=0 : conjugate can be on other processor!
-	    if(ix >= nc/2)
-	      continue;
-	    else {
-	      iix = nc - ix;
-	      if(iix == nc)
-		iix = 0;
-	      int iiy = nc - iy;
-	      if(iiy == nc)
-		iiy = 0;
+	    else { // here comes i!=0 : conjugate can be on other processor!
+	      if(ix >= nc/2)
+		continue;
+	      else {
+		size_t iix = nc - ix;
+		if(iix == nc)
+		  iix = 0;
 	      
-	      if(local_ix0 <= ix && ix < (local_ix0 + local_nx)) {
-		size_t index= ((ix - local_ix0)*nc + iy)*nckz + iz;
-		phi_k[index][0]= -delta_k_mag*cos(phase)/kmag2;
-		phi_k[index][1]= -delta_k_mag*sin(phase)/kmag2;
-	      }
+		long index= k_index(ix, iy, iz);
+		if(index >= 0) {
+		  phi_k[index][0]= -delta_k_mag*cos(phase)/kmag2;
+		  phi_k[index][1]= -delta_k_mag*sin(phase)/kmag2;
+		}
 	      
-	      if(local_ix0 <= iix && iix < (local_ix0 + local_nx)) {
-		size_t index= ((iix - local_ix0)*nc + iiy)*nckz + iz;
-		phi_k[index][0]= -delta_k_mag*cos(phase)/kmag2;
-		phi_k[index][1]=  delta_k_mag*sin(phase)/kmag2;
+		index= k_index(iix, iiy, iz);
+		if(index >= 0) {
+		  phi_k[index][0]= -delta_k_mag*cos(phase)/kmag2;
+		  phi_k[index][1]=  delta_k_mag*sin(phase)/kmag2;
+		}
 	      }
 	    }
 	  }
 	}
       }
     }
-  }
-
-  gsl_rng_free(random_generator);
 
-  fft_execute_inverse(fft_psi[0]);
-  return fft_psi[0];
+    gsl_rng_free(random_generator);
+  }
 }
 
 void lpt_generate_psi_k(const unsigned long seed, PowerSpectrum* const ps)
@@ -288,11 +439,17 @@ void lpt_generate_psi_k(const unsigned long seed, PowerSpectrum* const ps)
   
   complex_t* psi_k[]= {fft_psi[0]->fk, fft_psi[1]->fk, fft_psi[2]->fk};
 
-  const size_t nckz= nc/2 + 1;
   const double dk= 2.0*M_PI/boxsize;
   const double knq= nc*M_PI/boxsize; // Nyquist frequency
   const double fac= pow(2*M_PI/boxsize, 1.5);
   const double fac_2pi3= 1.0/(8.0*M_PI*M_PI*M_PI);
+
+  power_tabulate(ps, nc, boxsize);
+
+  if(random_mode == lpt_random_philox) {
+    generate_modes_philox(seed, ps, 0, psi_k);
+    return;
+  }
   
   gsl_rng* random_generator = gsl_rng_alloc(gsl_rng_ranlxd1);
   gsl_rng_set(random_generator, seed);
@@ -300,133 +457,150 @@ void lpt_generate_psi_k(const unsigned long seed, PowerSpectrum* const ps)
 
   
   // clean the delta_k grid
-  for(size_t ix=0; ix<local_nx; ix++)
-   for(size_t iy=0; iy<nc; iy++)
-    for(size_t iz=0; iz<nckz; iz++)
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy=0; iy<local_nky; iy++)
+   for(size_t ix=0; ix<nc; ix++)
+    for(size_t iz=0; iz<local_nkz; iz++)
       for(int i=0; i<3; i++) {
-	size_t index= (ix*nc + iy)*nckz + iz;
+	size_t index= (iy*nc + ix)*local_nkz + iz;
 	psi_k[i][index][0] = 0;
 	psi_k[i][index][1] = 0;
       }
 
-  double kvec[3];
-  for(size_t ix=0; ix<nc; ix++) {
-    size_t iix = nc - ix;
-    if(iix == nc)
-      iix = 0;
-
-    if(!((local_ix0 <= ix  && ix  < (local_ix0 + local_nx)) ||
-	 (local_ix0 <= iix && iix < (local_ix0 + local_nx))))
-      continue;
-    
-    for(size_t iy=0; iy<nc; iy++) {
-      gsl_rng_set(random_generator, seedtable[ix*nc + iy]);
-      
-      for(size_t iz=0; iz<nc/2; iz++) {
-	double phase= gsl_rng_uniform(random_generator)*2*M_PI;
-	double ampl;
-	do
-	  ampl = gsl_rng_uniform(random_generator);
-	while(ampl == 0.0);
-
-	if(ix == nc/2 || iy == nc/2 || iz == nc/2)
-	  continue;
-	if(ix == 0 && iy == 0 && iz == 0)
+  gsl_rng_free(random_generator);
+
+  // Modes are distributed in ky (and kz for pencils); every node follows
+  // the same random sequence per (ix, iy) column and keeps its own modes
+#ifdef _OPENMP
+  #pragma omp parallel default(shared)
+#endif
+  {
+    // one generator per thread, reseeded for each column
+    gsl_rng* random_generator = gsl_rng_alloc(gsl_rng_ranlxd1);
+    double kvec[3];
+
+#ifdef _OPENMP
+    #pragma omp for
+#endif
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iy=0; iy<nc; iy++) {
+	size_t iiy = nc - iy;
+	if(iiy == nc)
+	  iiy = 0;
+
+	if(!((local_iky0 <= iy  && iy  < (local_iky0 + local_nky)) ||
+	     (local_iky0 <= iiy && iiy < (local_iky0 + local_nky))))
 	  continue;
+
+	gsl_rng_set(random_generator, seedtable[ix*nc + iy]);
+      
+	for(size_t iz=0; iz<nc/2; iz++) {
+	  double phase= gsl_rng_uniform(random_generator)*2*M_PI + phase_shift;
+	  double ampl;
+	  do
+	    ampl = gsl_rng_uniform(random_generator);
+	  while(ampl == 0.0);
+
+	  if(ix == nc/2 || iy == nc/2 || iz == nc/2)
+	    continue;
+	  if(ix == 0 && iy == 0 && iz == 0)
+	    continue;
 	
-	if(ix < nc/2)
-	  kvec[0]= dk*ix;
-	else
-	  kvec[0]= -dk*(nc - ix);
+	  if(ix < nc/2)
+	    kvec[0]= dk*ix;
+	  else
+	    kvec[0]= -dk*(nc - ix);
 	
-	if(iy < nc/2)
-	  kvec[1]= dk*iy;
-	else
-	  kvec[1]= -dk*(nc - iy);
+	  if(iy < nc/2)
+	    kvec[1]= dk*iy;
+	  else
+	    kvec[1]= -dk*(nc - iy);
 	
-	if(iz < nc/2)
-	  kvec[2]= dk*iz;
-	else
-	  kvec[2]= -dk*(nc - iz);
+	  if(iz < nc/2)
+	    kvec[2]= dk*iz;
+	  else
+	    kvec[2]= -dk*(nc - iz);
 	
-	double kmag2 = kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2];
-	double kmag = sqrt(kmag2);
+	  double kmag2 = kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2];
 	
 #ifdef SPHEREMODE
-	// select a sphere in k-space
-	if(kmag > knq)
-	  continue;
+	  // select a sphere in k-space
+	  if(kmag2 > knq*knq)
+	    continue;
 #else
-	if(fabs(kvec[0]) > knq)
-	  continue;
-	if(fabs(kvec[1]) > knq)
-	  continue;
-	if(fabs(kvec[2]) > knq)
-	  continue;
+	  if(fabs(kvec[0]) > knq)
+	    continue;
+	  if(fabs(kvec[1]) > knq)
+	    continue;
+	  if(fabs(kvec[2]) > knq)
+	    continue;
 #endif
 	
-	//double p_of_k = PowerSpec(kmag); // = 1/(2pi)^3*P(k)
-	//double pk= fac_2pi3*power_spectrum(ps, kmag);	
-	//p_of_k *= -log(ampl);
+	  //double p_of_k = PowerSpec(kmag); // = 1/(2pi)^3*P(k)
+	  //double pk= fac_2pi3*power_spectrum(ps, kmag);	
+	  //p_of_k *= -log(ampl);
 
-	double delta2= -log(ampl)*fac_2pi3*power_spectrum(ps, kmag);
+	  double delta2= mode_power(ampl)*fac_2pi3*
+			   power_spectrum_k2(ps, k2_index(ix, iy, iz));
 	
-	double delta_k_mag= fac*sqrt(delta2);
-	// delta_k_mag -- |delta_k| extrapolated to a=1
-	// Displacement is extrapolated to a=1
-
-	if(iz > 0) {
-	  if(local_ix0 <= ix && ix < (local_ix0 + local_nx)) {
-	    size_t index= ((ix - local_ix0)*nc + iy)*nckz + iz;
-	    for(int i=0; i<3; i++) {
-	      psi_k[i][index][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
-	      psi_k[i][index][1]=  kvec[i]/kmag2*delta_k_mag*cos(phase);
+	  double delta_k_mag= fac*sqrt(delta2);
+	  // delta_k_mag -- |delta_k| extrapolated to a=1
+	  // Displacement is extrapolated to a=1
+
+	  if(iz > 0) {
+	    long index= k_index(ix, iy, iz);
+	    if(index >= 0) {
+	      for(int i=0; i<3; i++) {
+		psi_k[i][index][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
+		psi_k[i][index][1]=  kvec[i]/kmag2*delta_k_mag*cos(phase);
+	      }
 	    }
 	  }
-	}
-	else { // k=0 plane needs special treatment
-	  if(ix == 0) {
-	    if(iy >= nc/2)
-	      continue;
-	    else {
-	      if(local_ix0 <= ix && ix < (local_ix0 + local_nx)) {
-		size_t iiy= nc - iy; // note: j!=0 surely holds at this point
-		size_t index= ((ix - local_ix0)*nc + iy)*nckz + iz;				size_t iindex= ((ix - local_ix0)*nc + iiy)*nckz + iz;
+	  else { // k=0 plane needs special treatment
+	    if(ix == 0) {
+	      if(iy >= nc/2)
+		continue;
+	      else {
+		// note: j!=0 surely holds at this point
+		long index= k_index(ix, iy, iz);
+		long iindex= k_index(ix, iiy, iz);
 		
 		for(int i=0; i<3; i++) {
-		  psi_k[i][index][0]=  -kvec[i]/kmag2*delta_k_mag*sin(phase);
-		  psi_k[i][index][1]=   kvec[i]/kmag2*delta_k_mag*cos(phase);
-		  
-		  psi_k[i][iindex][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
-		  psi_k[i][iindex][1]= -kvec[i]/kmag2*delta_k_mag*cos(phase);
+		  if(index >= 0) {
+		    psi_k[i][index][0]=  -kvec[i]/kmag2*delta_k_mag*sin(phase);
+		    psi_k[i][index][1]=   kvec[i]/kmag2*delta_k_mag*cos(phase);
+		  }
+		  if(iindex >= 0) {
+		    psi_k[i][iindex][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
+		    psi_k[i][iindex][1]= -kvec[i]/kmag2*delta_k_mag*cos(phase);
+		  }
 		}
 	      }
 	    }
-	  }
-	  else { // here comes i!=0 : conjugate can be on other processor!
-	    if(ix >= nc/2)
-	      continue;
-	    else {
-	      iix = nc - ix;
-	      if(iix == nc)
-		iix = 0;
-	      int iiy = nc - iy;
-	      if(iiy == nc)
-		iiy = 0;
+	    else { // here comes i!=0 : conjugate can be on other processor!
+	      if(ix >= nc/2)
+		continue;
+	      else {
+		size_t iix = nc - ix;
+		if(iix == nc)
+		  iix = 0;
 	      
-	      if(local_ix0 <= ix && ix < (local_ix0 + local_nx)) {
-		size_t index= ((ix - local_ix0)*nc + iy)*nckz + iz;
-		for(int i=0; i<3; i++) {
-		  psi_k[i][index][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
-		  psi_k[i][index][1]=  kvec[i]/kmag2*delta_k_mag*cos(phase);
+		long index= k_index(ix, iy, iz);
+		if(index >= 0) {
+		  for(int i=0; i<3; i++) {
+		    psi_k[i][index][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
+		    psi_k[i][index][1]=  kvec[i]/kmag2*delta_k_mag*cos(phase);
+		  }
 		}
-	      }
 	      
-	      if(local_ix0 <= iix && iix < (local_ix0 + local_nx)) {
-		size_t index= ((iix - local_ix0)*nc + iiy)*nckz + iz;
-		for(int i=0; i<3; i++) {
-		  psi_k[i][index][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
-		  psi_k[i][index][1]= -kvec[i]/kmag2*delta_k_mag*cos(phase);
+		index= k_index(iix, iiy, iz);
+		if(index >= 0) {
+		  for(int i=0; i<3; i++) {
+		    psi_k[i][index][0]= -kvec[i]/kmag2*delta_k_mag*sin(phase);
+		    psi_k[i][index][1]= -kvec[i]/kmag2*delta_k_mag*cos(phase);
+		  }
 		}
 	      }
 	    }
@@ -434,11 +608,164 @@ void lpt_generate_psi_k(const unsigned long seed, PowerSpectrum* const ps)
 	}
       }
     }
+
+    gsl_rng_free(random_generator);
+  }  
+}
+
+//
+// Counter-based random numbers, Philox4x32-10
+//   Salmon et al. (2011) "Parallel random numbers: as easy as 1, 2, 3"
+// The random numbers of mode (ix, iy, iz) are a function of the seed and
+// (ix, iy, iz) only, so that each node, and each thread, generates its
+// own modes in any order, independent of the decomposition.
+//
+
+static inline void philox4x32(uint32_t ctr[], const uint32_t key_[])
+{
+  // ctr <- Philox4x32-10(ctr, key), in place
+  const uint32_t m0= 0xD2511F53, m1= 0xCD9E8D57;
+  const uint32_t w0= 0x9E3779B9, w1= 0xBB67AE85;
+  uint32_t key[2]= {key_[0], key_[1]};
+
+  for(int round=0; round<10; round++) {
+    const uint64_t p0= (uint64_t) m0*ctr[0];
+    const uint64_t p1= (uint64_t) m1*ctr[2];
+    const uint32_t c0= (uint32_t)(p1 >> 32) ^ ctr[1] ^ key[0];
+    const uint32_t c2= (uint32_t)(p0 >> 32) ^ ctr[3] ^ key[1];
+    ctr[0]= c0; ctr[1]= (uint32_t) p1;
+    ctr[2]= c2; ctr[3]= (uint32_t) p0;
+    key[0] += w0; key[1] += w1;
+  }
+}
+
+#ifdef CHECK
+static void philox4x32_check(void)
+{
+  // Known-answer test vectors of Random123 (kat_vectors, philox4x32 10)
+  uint32_t ctr[3][4]= {{0, 0, 0, 0},
+		       {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+		       {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}};
+  const uint32_t key[3][2]= {{0, 0},
+			     {0xffffffff, 0xffffffff},
+			     {0xa4093822, 0x299f31d0}};
+  const uint32_t expected[3][4]= {
+    {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8},
+    {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd},
+    {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}};
+
+  for(int i=0; i<3; i++) {
+    philox4x32(ctr[i], key[i]);
+    for(int j=0; j<4; j++)
+      assert(ctr[i][j] == expected[i][j]);
+  }
+}
+#endif
+
+static inline double philox_uniform(const uint32_t hi, const uint32_t lo)
+{
+  // Uniform random number in (0, 1) from 53 bits of hi and lo
+  const uint64_t u= ((uint64_t) hi << 21) | (lo >> 11);
+  return (u + 0.5)*(1.0/9007199254740992.0);
+}
+
+static inline bool mode_delta_k(const unsigned long seed,
+				PowerSpectrum* const ps,
+				const size_t ix, const size_t iy, const size_t iz,
+				double kvec[], double delta[])
+{
+  // Linear delta(k) extrapolated to a=1 for mode (ix, iy, iz), iz <= nc/2,
+  // and its wave vector. Returns false for modes that are zero: k=0, the
+  // Nyquist planes, and outside the Nyquist cube (sphere).
+  if(ix == nc/2 || iy == nc/2 || iz == nc/2)
+    return false;
+  if(ix == 0 && iy == 0 && iz == 0)
+    return false;
+
+  const double dk= 2.0*M_PI/boxsize;
+  const double knq= nc*M_PI/boxsize; // Nyquist frequency
+  const double fac= pow(2*M_PI/boxsize, 1.5);
+  const double fac_2pi3= 1.0/(8.0*M_PI*M_PI*M_PI);
+
+  kvec[0]= ix < nc/2 ? dk*ix : -dk*(nc - ix);
+  kvec[1]= iy < nc/2 ? dk*iy : -dk*(nc - iy);
+  kvec[2]= dk*iz;
+
+#ifdef SPHEREMODE
+  if(kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2] > knq*knq)
+    return false;
+#else
+  if(fabs(kvec[0]) > knq || fabs(kvec[1]) > knq || fabs(kvec[2]) > knq)
+    return false;
+#endif
+
+  // kz=0 plane: delta(-k) = delta(k)^*; the random numbers are those of
+  // the mode with kx > 0, or kx = 0 and ky > 0
+  size_t jx= ix, jy= iy;
+  bool conj= false;
+  if(iz == 0 && (ix > nc/2 || (ix == 0 && iy > nc/2))) {
+    jx= (nc - ix) % nc;
+    jy= (nc - iy) % nc;
+    conj= true;
   }
 
-  gsl_rng_free(random_generator);  
+  uint32_t ctr[4]= {jx, jy, iz, 0};
+  const uint32_t key[2]= {(uint32_t) seed, (uint32_t)((uint64_t) seed >> 32)};
+  philox4x32(ctr, key);
+
+  const double phase= philox_uniform(ctr[0], ctr[1])*2*M_PI + phase_shift;
+  const double ampl= philox_uniform(ctr[2], ctr[3]);
+
+  const double delta2= mode_power(ampl)*fac_2pi3*
+                       power_spectrum_k2(ps, k2_index(ix, iy, iz));
+  const double delta_k_mag= fac*sqrt(delta2);
+
+  delta[0]= delta_k_mag*cos(phase);
+  delta[1]= conj ? -delta_k_mag*sin(phase) : delta_k_mag*sin(phase);
+
+  return true;
 }
 
+void generate_modes_philox(const unsigned long seed, PowerSpectrum* const ps,
+			   complex_t* const phi_k, complex_t* psi_k[])
+{
+  // Sets the local modes of phi_k= -delta_k/k^2 if phi_k is not null, and
+  // psi_k[i]= i k_i/k^2 delta_k if psi_k is not null, in the transposed
+  // layout, with counter-based random numbers
+#ifdef CHECK
+  philox4x32_check();
+#endif
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iz_local=0; iz_local<local_nkz; iz_local++) {
+	const size_t iz= iz_local + local_ikz0;
+	const size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	double kvec[3]= {0.0, 0.0, 0.0}, delta[2]= {0.0, 0.0};
+	double kmag2= 1.0;
+
+	if(mode_delta_k(seed, ps, ix, iy, iz, kvec, delta))
+	  kmag2= kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2];
+
+	if(phi_k) {
+	  phi_k[index][0]= -delta[0]/kmag2;
+	  phi_k[index][1]= -delta[1]/kmag2;
+	}
+
+	if(psi_k) {
+	  for(int i=0; i<3; i++) {
+	    psi_k[i][index][0]= -kvec[i]/kmag2*delta[1];
+	    psi_k[i][index][1]=  kvec[i]/kmag2*delta[0];
+	  }
+	}
+      }
+    }
+  }
+}
 
 void lpt_compute_psi2_k(void)
 {
@@ -448,13 +775,11 @@ void lpt_compute_psi2_k(void)
   
   msg_printf(msg_verbose, "Computing 2LPT displacement fields...\n");
 
-  const size_t nckz= nc/2 + 1;
   const double dk= 2.0*M_PI/boxsize;
 
   complex_t* psi_k[]= {fft_psi[0]->fk, fft_psi[1]->fk, fft_psi[2]->fk};
 
   //const double fac = pow(2*M_PI/boxsize, 1.5);
-  double kvec[3];
 
   //
   // 2nd order LPT
@@ -469,14 +794,20 @@ void lpt_compute_psi2_k(void)
   //  printf("debug-pre %e\n", fft_psi[0]->fk[i][0]);
 
   // Take derivative dPsi_i/dq_j in Fourier space
-  for(size_t ix=0; ix<local_nx; ix++) {
-    for(size_t iy=0; iy<nc; iy++) {
-      for(size_t iz=0; iz<nckz; iz++) {
-	size_t index= (ix*nc + iy)*nckz + iz;
-	if((ix + local_ix0) < nc/2)
-	  kvec[0]= dk*(ix + local_ix0);
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iz_local=0; iz_local<local_nkz; iz_local++) {
+	const size_t iz= iz_local + local_ikz0;
+	size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	double kvec[3];
+	if(ix < nc/2)
+	  kvec[0]= dk*ix;
 	else
-	  kvec[0]= -dk*(nc - (ix + local_ix0));
+	  kvec[0]= -dk*(nc - ix);
 	      
 	if(iy < nc/2)
 	  kvec[1]= dk*iy;
@@ -525,19 +856,31 @@ void lpt_compute_psi2_k(void)
 
   float_t* psi_ij[6]; for(int i=0; i<6; i++) psi_ij[i]= fft_psi_ij[i]->fx;
   float_t* const div_psi2= fft_div_psi2->fx; // == fft_psi_ij[3];
+  float_t* const det_psi= fft_psi_ij[4]->fx; // 3LPT source det(Psi_i,j)
 
   size_t nczr= 2*(nc/2 + 1);
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
   for(size_t ix=0; ix<local_nx; ix++) {
-    for(size_t iy=0; iy<nc; iy++) {
+    for(size_t iy=0; iy<local_ny; iy++) {
       for(size_t iz=0; iz<nc; iz++) {
-	size_t index= (ix*nc + iy)*nczr + iz;
+	size_t index= (ix*local_ny + iy)*nczr + iz;
+	const float_t p11= psi_ij[0][index], p12= psi_ij[1][index];
+	const float_t p13= psi_ij[2][index], p22= psi_ij[3][index];
+	const float_t p23= psi_ij[4][index], p33= psi_ij[5][index];
 
 	div_psi2[index]=
-	    psi_ij[0][index]*(psi_ij[3][index] + psi_ij[5][index])
-	  + psi_ij[3][index]*psi_ij[5][index]
-          - psi_ij[1][index]*psi_ij[1][index]
-          - psi_ij[2][index]*psi_ij[2][index]
-	  - psi_ij[4][index]*psi_ij[4][index];
+	    p11*(p22 + p33)
+	  + p22*p33
+          - p12*p12
+          - p13*p13
+	  - p23*p23;
+
+	// written in place of Psi_2,3, after all six are read
+	if(lpt_order == 3)
+	  det_psi[index]= p11*(p22*p33 - p23*p23) - p12*(p12*p33 - p23*p13)
+	                + p13*(p12*p23 - p22*p13);
       }
     }
   }
@@ -546,24 +889,37 @@ void lpt_compute_psi2_k(void)
   msg_printf(msg_verbose, "Fourier transforming second order source...\n");
   
   fft_execute_forward(fft_div_psi2);
+
+  if(lpt_order == 3) {
+    fft_execute_forward(fft_psi_ij[4]);
+    lpt_compute_psi3b_source();
+  }
+
   complex_t* div_psi2_k= fft_div_psi2->fk;
   complex_t* psi2_k[]= {fft_psi2[0]->fk, fft_psi2[1]->fk, fft_psi2[2]->fk};
 
-  if(local_ix0 == 0) {
+  if(local_iky0 == 0 && local_ikz0 == 0 && local_nky > 0 && local_nkz > 0) {
     for(int i=0; i<3; i++)
       psi2_k[i][0][0]= psi2_k[i][0][1] = 0.0;
     // avoid zero division kmag2 = 0
   }
 	    
-  for(size_t ix=0; ix<local_nx; ix++) {
-    for(size_t iy=0; iy<nc; iy++) {
-      int iz0= (ix + local_ix0 == 0) && (iy == 0); // skip kvec=(0,0,0)
-      for(size_t iz=iz0; iz<nckz; iz++) {
-	size_t index= (ix*nc + iy)*nckz + iz;
-	if((ix + local_ix0) < nc/2)
-	  kvec[0]=  dk*(ix + local_ix0);
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    for(size_t ix=0; ix<nc; ix++) {
+      // skip kvec=(0,0,0)
+      int iz0= (ix == 0) && (iy == 0) && (local_ikz0 == 0);
+      for(size_t iz_local=iz0; iz_local<local_nkz; iz_local++) {
+	const size_t iz= iz_local + local_ikz0;
+	size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	double kvec[3];
+	if(ix < nc/2)
+	  kvec[0]=  dk*ix;
 	else
-	  kvec[0]= -dk*(nc - (ix + local_ix0));
+	  kvec[0]= -dk*(nc - ix);
 	
 	if(iy < nc/2)
 	  kvec[1]= dk*iy;
@@ -596,12 +952,19 @@ void lpt_set_displacements(const unsigned long seed, PowerSpectrum* const ps,
 {
   msg_printf(msg_verbose, "Computing 2LPT\n");
   assert(particles);
-  size_t np_local= local_nx*nc*nc;
+  size_t np_local= local_nx*local_ny*nc;
   if(particles->np_allocated < np_local)
     msg_abort("Error: Not enough particles allocated to put initial particles\n"
 	      "np_allocated= %lu < required %lu\n",
 	      particles->np_allocated, np_local);
  
+  if(low_memory) {
+    if(lpt_order == 3)
+      msg_abort("Error: 3LPT requires memory for 9 LPT meshes\n");
+    set_displacements_low_memory(seed, ps, a, particles);
+    return;
+  }
+
   lpt_generate_psi_k(seed, ps);
   //for(int i=0; i<64*64; i++)
   //  printf("fk %e\n", fft_psi[0]->fk[i][0]);
@@ -626,10 +989,8 @@ void lpt_set_displacements(const unsigned long seed, PowerSpectrum* const ps,
 
   const size_t nczr= 2*(nc/2 + 1);
   const float_t dx= boxsize/nc;
-  Particle* p= particles->p;
 
   double nmesh3_inv= 1.0/pow((double)nc, 3.0);
-  uint64_t id= (uint64_t) local_ix0*nc*nc + 1;
 
   const float_t D1= cosmology_D_growth(a);
   const float_t D2= cosmology_D2_growth(a, D1);
@@ -639,24 +1000,41 @@ void lpt_set_displacements(const unsigned long seed, PowerSpectrum* const ps,
 
   double sum2= 0.0;
 
+  float_t unit1_inv[3], unit2_inv[3];
+  for(int k=0; k<3; k++) {
+    particles->dx1_unit[k]= displacement_unit(psi[k], 1.0);
+    particles->dx2_unit[k]= displacement_unit(psi2[k], nmesh3_inv);
+    unit1_inv[k]= 1.0/particles->dx1_unit[k];
+    unit2_inv[k]= 1.0/particles->dx2_unit[k];
+  }
+
   const float_t offset= 0.5f; // debug!! 0.5 for test
-  float_t x[3];
+
+  // Each (ix, iy) row has its own particle, id and position bases
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared) reduction(+:sum2)
+#endif
   for(size_t ix=0; ix<local_nx; ix++) {
-   x[0]= (local_ix0 + ix + offset)*dx;
-   for(size_t iy=0; iy<nc; iy++) {
-    x[1]= (iy + offset)*dx;
+   pos_t x[3];
+   x[0]= lattice_pos(local_ix0 + ix, offset, dx);
+   for(size_t iy=0; iy<local_ny; iy++) {
+    x[1]= lattice_pos(local_iy0 + iy, offset, dx);
+    uint64_t id= ((uint64_t)(local_ix0 + ix)*nc + local_iy0 + iy)*nc + 1;
+    Particle* p= particles->p + (ix*local_ny + iy)*nc;
     for(int iz=0; iz<nc; iz++) {
-     x[2]= (iz + offset)*dx;
+     x[2]= lattice_pos(iz, offset, dx);
 
-     size_t index= (ix*nc + iy)*nczr + iz;
+     size_t index= (ix*local_ny + iy)*nczr + iz;
      for(int k=0; k<3; k++) {
        float_t dis=  psi[k][index];
        float_t dis2= nmesh3_inv*psi2[k][index];
        // psi2 had two inverse Fourier transofroms, giving additional nmesh3
        
-       p->x[k]= x[k] + D1*dis + D2*dis2;
-       p->dx1[k]= dis;              // 1LPT extrapolated to a=1
-       p->dx2[k]= dis2;             // 2LPT displacement
+       p->x[k]= pos_add(pos_add(x[k], D1*dis, boxsize), D2*dis2, boxsize);
+       p->dx1[k]= dx_compress(dis, unit1_inv[k]);
+                                    // 1LPT extrapolated to a=1
+       p->dx2[k]= dx_compress(dis2, unit2_inv[k]);
+                                    // 2LPT displacement
                                     // multiply by cosmology_D2_growth() for a
        p->v[k]= 0;                  // velocity in comoving 2LPT
 
@@ -674,12 +1052,13 @@ void lpt_set_displacements(const unsigned long seed, PowerSpectrum* const ps,
    }
   }
 
-  msg_printf(msg_debug, "disp rms %e\n", sqrt(sum2/(local_nx*nc*nc)));
-  p= particles->p;
+  msg_printf(msg_debug, "disp rms %e\n", sqrt(sum2/(local_nx*local_ny*nc)));
   //for(int i=0; i<nc*nc*nc; i++) {
   //  fprintf(stderr, "%e %e %e\n", p->x[0], p->x[1], p->x[2]);
   //}
 
+  if(lpt_order == 3)
+    add_third_order(a, particles);
   
   msg_printf(msg_verbose, "2LPT displacements calculated.\n");
   
@@ -688,3 +1067,417 @@ void lpt_set_displacements(const unsigned long seed, PowerSpectrum* const ps,
   particles->a_v= 0.0;
 }
 
+void lpt_set_displacements_batch(const unsigned long seeds[], const int nseed,
+				 PowerSpectrum* const ps, const double a,
+				 Particles* particles,
+				 LptWriter writer, void* const data)
+{
+  // 2LPT initial conditions for many random seeds in one run.
+  // The FFT meshes and plans, the seed table and the P(k) table are set up
+  // once; writer(seed, particles, data) is called for each realization
+  // before the next one overwrites the particles.
+  //
+  // The LPT meshes live in the Mem given to lpt_init(), which main.c
+  // shares with the PM density and work meshes (mem1). Run the batch
+  // before the first pm_compute_forces(), and do not call PM from writer;
+  // otherwise give lpt_init() a Mem of its own.
+  assert(writer);
+
+  for(int i=0; i<nseed; i++) {
+    msg_printf(msg_info, "Realization %d/%d\n", i + 1, nseed);
+    lpt_set_displacements(seeds[i], ps, a, particles);
+    writer(seeds[i], particles, data);
+  }
+}
+
+
+static inline void k_vector(const size_t ix, const size_t iy, const size_t iz,
+			    double kvec[])
+{
+  // Wave vector of mode (ix, iy, iz)
+  const double dk= 2.0*M_PI/boxsize;
+  kvec[0]= ix < nc/2 ? dk*ix : -dk*(nc - ix);
+  kvec[1]= iy < nc/2 ? dk*iy : -dk*(nc - iy);
+  kvec[2]= iz < nc/2 ? dk*iz : -dk*(nc - iz);
+}
+
+static void phi_derivative_k(complex_t* const f, const int i, const int j)
+{
+  // f = Psi_i,j(k) = k_i k_j phi_k for i, j >= 0, or
+  // f = -Psi_i,i(k) = delta_k = -k^2 phi_k for i < 0
+  complex_t const * const phi_k= fft_psi[0]->fk;
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iz_local=0; iz_local<local_nkz; iz_local++) {
+	const size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	double kvec[3];
+	k_vector(ix, iy, iz_local + local_ikz0, kvec);
+
+	const double fac= i < 0 ?
+	  -(kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2]) :
+	  kvec[i]*kvec[j];
+	f[index][0]= fac*phi_k[index][0];
+	f[index][1]= fac*phi_k[index][1];
+      }
+    }
+  }
+}
+
+static void displacement_k(complex_t* const f, complex_t const * const g,
+			   const int i, const bool laplacian_inv)
+{
+  // f = -sqrt(-1) k_i g(k), divided by k^2 if laplacian_inv, zero for k=0
+  //   Psi_i(k)    = -sqrt(-1) k_i phi_k
+  //   Psi(2)_i(k) = -sqrt(-1) k_i/k^2 div.Psi(2)_k
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iz_local=0; iz_local<local_nkz; iz_local++) {
+	const size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	double kvec[3];
+	k_vector(ix, iy, iz_local + local_ikz0, kvec);
+
+	const double kmag2= kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2];
+	double fac= kvec[i];
+	if(laplacian_inv)
+	  fac= kmag2 > 0.0 ? fac/kmag2 : 0.0;
+
+	const double re= g[index][0], im= g[index][1];
+	f[index][0]=  fac*im;
+	f[index][1]= -fac*re;
+      }
+    }
+  }
+}
+
+void set_displacements_low_memory(const unsigned long seed,
+				  PowerSpectrum* const ps,
+				  const double a, Particles* particles)
+{
+  // 2LPT with 3 meshes: phi_k in fft_psi[0], one derivative or
+  // displacement at a time in fft_psi[1], and div.Psi(2) in fft_psi[2].
+  // Because Sum_i Psi_i,i = -delta, the second-order source is a sum of
+  // squares of one field at a time,
+  //   div.Psi(2) = 1/2 delta^2 - 1/2 Sum_i Psi_i,i^2 - Sum_{i<j} Psi_i,j^2
+  FFT* const fft_work= fft_psi[1];
+  FFT* const fft_div= fft_psi[2];
+  float_t* const work= fft_work->fx;
+  float_t* const div_psi2= fft_div->fx;
+  const size_t nczr= 2*(nc/2 + 1);
+
+  lpt_generate_phi_k(seed, ps);
+
+  msg_printf(msg_verbose, "Accumulating second order source...\n");
+  const int ij[][2]= {{-1, -1}, {0, 0}, {1, 1}, {2, 2}, {0, 1}, {0, 2}, {1, 2}};
+  for(int n=0; n<7; n++) {
+    const int i= ij[n][0], j= ij[n][1];
+    phi_derivative_k(fft_work->fk, i, j);
+    fft_execute_inverse(fft_work);
+
+    const float_t w= i < 0 ? 0.5 : (i == j ? -0.5 : -1.0);
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared)
+#endif
+    for(size_t ix=0; ix<local_nx; ix++) {
+      for(size_t iy=0; iy<local_ny; iy++) {
+	for(size_t iz=0; iz<nc; iz++) {
+	  size_t index= (ix*local_ny + iy)*nczr + iz;
+	  if(n == 0)
+	    div_psi2[index]= w*work[index]*work[index];
+	  else
+	    div_psi2[index] += w*work[index]*work[index];
+	}
+      }
+    }
+  }
+
+  fft_execute_forward(fft_div);
+
+  // Displacements, one component at a time
+  const float_t dx= boxsize/nc;
+  const float_t offset= 0.5f;
+  const double nmesh3_inv= 1.0/pow((double)nc, 3.0);
+  const float_t D1= cosmology_D_growth(a);
+  const float_t D2= cosmology_D2_growth(a, D1);
+
+  msg_printf(msg_verbose, "LPT growth factor for a=%e: D1= %e, D2= %e\n",
+	     a, D1, D2);
+
+  double sum2= 0.0;
+  
+  for(int k=0; k<3; k++) {
+    // 1LPT displacement extrapolated to a=1
+    displacement_k(fft_work->fk, fft_psi[0]->fk, k, false);
+    fft_execute_inverse(fft_work);
+
+    particles->dx1_unit[k]= displacement_unit(work, 1.0);
+    const float_t unit1_inv= 1.0/particles->dx1_unit[k];
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared)
+#endif
+    for(size_t ix=0; ix<local_nx; ix++) {
+      for(size_t iy=0; iy<local_ny; iy++) {
+	Particle* p= particles->p + (ix*local_ny + iy)*nc;
+	for(size_t iz=0; iz<nc; iz++) {
+	  const size_t q[]= {local_ix0 + ix, local_iy0 + iy, iz};
+	  const float_t dis= work[(ix*local_ny + iy)*nczr + iz];
+	  p->x[k]= pos_add(lattice_pos(q[k], offset, dx), D1*dis, boxsize);
+	  p->dx1[k]= dx_compress(dis, unit1_inv);
+	  p++;
+	}
+      }
+    }
+
+    // 2LPT displacement; two inverse Fourier transforms give nmesh3
+    displacement_k(fft_work->fk, fft_div->fk, k, true);
+    fft_execute_inverse(fft_work);
+
+    particles->dx2_unit[k]= displacement_unit(work, nmesh3_inv);
+    const float_t unit1= particles->dx1_unit[k];
+    const float_t unit2_inv= 1.0/particles->dx2_unit[k];
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared) reduction(+:sum2)
+#endif
+    for(size_t ix=0; ix<local_nx; ix++) {
+      for(size_t iy=0; iy<local_ny; iy++) {
+	Particle* p= particles->p + (ix*local_ny + iy)*nc;
+	uint64_t id= ((uint64_t)(local_ix0 + ix)*nc + local_iy0 + iy)*nc + 1;
+	for(size_t iz=0; iz<nc; iz++) {
+	  const float_t dis= unit1*p->dx1[k]; // rms diagnostic only
+	  const float_t dis2= nmesh3_inv*work[(ix*local_ny + iy)*nczr + iz];
+
+	  p->x[k]= pos_add(p->x[k], D2*dis2, boxsize);
+	  p->dx2[k]= dx_compress(dis2, unit2_inv);
+	  p->v[k]= 0;
+	  p->id= id++;
+
+	  sum2 += (D1*dis + D2*dis2)*(D1*dis + D2*dis2);
+	  p++;
+	}
+      }
+    }
+  }
+
+  msg_printf(msg_debug, "disp rms %e\n", sqrt(sum2/(local_nx*local_ny*nc)));
+  msg_printf(msg_verbose, "2LPT displacements calculated.\n");
+
+  particles->np_local= local_nx*local_ny*nc;
+  particles->a_x= a;
+  particles->a_v= 0.0;
+}
+
+static void psi_derivative_k(complex_t* const f, const int i, const int j)
+{
+  // f = Psi_i,j(k) = sqrt(-1) k_j Psi_i(k) for i, j >= 0, or
+  // f = div.Psi(k) for i < 0, from Psi_k in fft_psi[]->fk
+  complex_t const * const psi_k[]= {fft_psi[0]->fk, fft_psi[1]->fk,
+				    fft_psi[2]->fk};
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iz_local=0; iz_local<local_nkz; iz_local++) {
+	const size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	double kvec[3];
+	k_vector(ix, iy, iz_local + local_ikz0, kvec);
+
+	double re= 0.0, im= 0.0;
+	if(i >= 0) {
+	  re= -kvec[j]*psi_k[i][index][1];
+	  im=  kvec[j]*psi_k[i][index][0];
+	}
+	else {
+	  for(int l=0; l<3; l++) {
+	    re -= kvec[l]*psi_k[l][index][1];
+	    im += kvec[l]*psi_k[l][index][0];
+	  }
+	}
+	f[index][0]= re;
+	f[index][1]= im;
+      }
+    }
+  }
+}
+
+static void psi2_derivative_k(complex_t* const f, complex_t const * const g,
+			      const int i, const int j)
+{
+  // f = Psi(2)_i,j(k) = k_i k_j/k^2 div.Psi(2)_k for i, j >= 0, or
+  // f = div.Psi(2)_k for i < 0, with div.Psi(2)_k in g
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    for(size_t ix=0; ix<nc; ix++) {
+      for(size_t iz_local=0; iz_local<local_nkz; iz_local++) {
+	const size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	double kvec[3];
+	k_vector(ix, iy, iz_local + local_ikz0, kvec);
+
+	const double kmag2= kvec[0]*kvec[0] + kvec[1]*kvec[1] + kvec[2]*kvec[2];
+	double fac= 1.0;
+	if(i >= 0)
+	  fac= kmag2 > 0.0 ? kvec[i]*kvec[j]/kmag2 : 0.0;
+
+	f[index][0]= fac*g[index][0];
+	f[index][1]= fac*g[index][1];
+      }
+    }
+  }
+}
+
+void lpt_compute_psi3b_source(void)
+{
+  // Second 3LPT source from Psi_k in fft_psi[] and div.Psi(2)_k in
+  // fft_div_psi2, into fft_psi_ij[5] (Fourier space)
+  //   div.Psi(3b) = 1/2 Sum_{i!=j} [Psi(2)_i,i Psi_j,j - Psi(2)_i,j Psi_i,j]
+  //               = 1/2 div.Psi(2) div.Psi - 1/2 Sum_{i,j} Psi(2)_i,j Psi_i,j
+  // accumulated one pair of fields at a time; fft_psi_ij[0,1] are work
+  msg_printf(msg_verbose, "Computing 3LPT source...\n");
+
+  FFT* const fft_work1= fft_psi_ij[0];
+  FFT* const fft_work2= fft_psi_ij[1];
+  FFT* const fft_src= fft_psi_ij[5];
+  float_t* const work1= fft_work1->fx;
+  float_t* const work2= fft_work2->fx;
+  float_t* const src= fft_src->fx;
+  const size_t nczr= 2*(nc/2 + 1);
+
+  // div.Psi(2)_k had a forward transform without 1/nc^3
+  const float_t nmesh3_inv= 1.0/pow((double)nc, 3.0);
+
+  const int ij[][2]= {{-1, -1}, {0, 0}, {1, 1}, {2, 2}, {0, 1}, {0, 2}, {1, 2}};
+  for(int n=0; n<7; n++) {
+    const int i= ij[n][0], j= ij[n][1];
+    psi2_derivative_k(fft_work1->fk, fft_div_psi2->fk, i, j);
+    fft_execute_inverse(fft_work1);
+    psi_derivative_k(fft_work2->fk, i, j);
+    fft_execute_inverse(fft_work2);
+
+    const float_t w= nmesh3_inv*(i < 0 ? 0.5 : (i == j ? -0.5 : -1.0));
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared)
+#endif
+    for(size_t ix=0; ix<local_nx; ix++) {
+      for(size_t iy=0; iy<local_ny; iy++) {
+	for(size_t iz=0; iz<nc; iz++) {
+	  size_t index= (ix*local_ny + iy)*nczr + iz;
+	  if(n == 0)
+	    src[index]= w*work1[index]*work2[index];
+	  else
+	    src[index] += w*work1[index]*work2[index];
+	}
+      }
+    }
+  }
+
+  fft_execute_forward(fft_src);
+}
+
+void add_third_order(const double a, Particles* const particles)
+{
+  // Adds Psi(3) = D3a Psi(3a) + D3b Psi(3b) to the particle positions and
+  // sets the velocities to its time derivative, from the sources
+  // det(Psi_i,j) in fft_psi_ij[4] and div.Psi(3b) in fft_psi_ij[5] in
+  // Fourier space; fft_psi_ij[3] is work
+  FFT* const fft_work= fft_psi_ij[3];
+  float_t* const work= fft_work->fx;
+  complex_t* const work_k= fft_work->fk;
+  complex_t const * const src_a= fft_psi_ij[4]->fk;
+  complex_t const * const src_b= fft_psi_ij[5]->fk;
+  const size_t nczr= 2*(nc/2 + 1);
+  const double nmesh3_inv= 1.0/pow((double)nc, 3.0);
+
+  const double D1= cosmology_D_growth(a);
+  const double D3a= cosmology_D3a_growth(a, D1);
+  const double D3b= cosmology_D3b_growth(a, D1);
+  const float_t D3v= cosmology_D3v_growth(a, 1.0);
+
+  msg_printf(msg_verbose, "3LPT growth factor for a=%e: D3a= %e, D3b= %e\n",
+	     a, D3a, D3b);
+
+  for(int k=0; k<3; k++) {
+    // Psi(3)_k = -sqrt(-1) k/k^2 (D3a det + D3b div.Psi(3b))
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared)
+#endif
+    for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+      const size_t iy= iy_local + local_iky0;
+      for(size_t ix=0; ix<nc; ix++) {
+	for(size_t iz_local=0; iz_local<local_nkz; iz_local++) {
+	  const size_t index= (iy_local*nc + ix)*local_nkz + iz_local;
+	  double kvec[3];
+	  k_vector(ix, iy, iz_local + local_ikz0, kvec);
+
+	  const double kmag2= kvec[0]*kvec[0] + kvec[1]*kvec[1] +
+	                      kvec[2]*kvec[2];
+	  const double fac= kmag2 > 0.0 ? nmesh3_inv*kvec[k]/kmag2 : 0.0;
+	  const double re= D3a*src_a[index][0] + D3b*src_b[index][0];
+	  const double im= D3a*src_a[index][1] + D3b*src_b[index][1];
+	  work_k[index][0]=  fac*im;
+	  work_k[index][1]= -fac*re;
+	}
+      }
+    }
+
+    fft_execute_inverse(fft_work);
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared)
+#endif
+    for(size_t ix=0; ix<local_nx; ix++) {
+      for(size_t iy=0; iy<local_ny; iy++) {
+	Particle* p= particles->p + (ix*local_ny + iy)*nc;
+	for(size_t iz=0; iz<nc; iz++) {
+	  const float_t dis3= work[(ix*local_ny + iy)*nczr + iz];
+	  p->x[k]= pos_add(p->x[k], dis3, boxsize);
+	  p->v[k]= D3v*dis3;
+	  p++;
+	}
+      }
+    }
+  }
+}
+
+float_t displacement_unit(float_t const * const f, const double fac)
+{
+  // Displacement per stored dx1, dx2 value for the real-space mesh f
+  // multiplied by fac: max|fac f|/32767 over all nodes for COMPACT_LPT int16
+  // storage, so that no value is clipped; 1 otherwise
+#ifdef COMPACT_LPT
+  const size_t nczr= 2*(nc/2 + 1);
+  double fmax= 0.0;
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared) reduction(max:fmax)
+#endif
+  for(size_t ix=0; ix<local_nx; ix++) {
+    for(size_t iy=0; iy<local_ny; iy++) {
+      for(size_t iz=0; iz<nc; iz++) {
+	const double d= fabs(fac*f[(ix*local_ny + iy)*nczr + iz]);
+	if(d > fmax) fmax= d;
+      }
+    }
+  }
+
+  comm_max_double(&fmax, 1);
+
+  return fmax > 0.0 ? fmax/32767.0 : 1.0;
+#else
+  return 1;
+#endif
+}
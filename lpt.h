@@ -1,13 +1,27 @@
 #ifndef LPT_H
 #define LPT_H 1
 
+#include <stdbool.h>
 #include "mem.h"
 #include "particle.h"
 #include "power.h"
 
+enum LptRandom {lpt_random_ngenic, lpt_random_philox};
+
+typedef void (*LptWriter)(const unsigned long seed, Particles* const particles,
+			  void* const data);
+
 void lpt_init(const int nc, const double boxsize, Mem* mem);
 void lpt_set_displacements(const unsigned long seed, PowerSpectrum* const ps,
 			   const double a, Particles* particles);
+void lpt_set_displacements_batch(const unsigned long seeds[], const int nseed,
+				 PowerSpectrum* const ps, const double a,
+				 Particles* particles,
+				 LptWriter writer, void* const data);
 FFT* lpt_generate_phi(const unsigned long seed, PowerSpectrum* const);
+void lpt_set_random(const enum LptRandom mode);
+void lpt_set_low_memory(const bool low);
+void lpt_set_order(const int order);
+void lpt_set_fixed_paired(const bool fixed, const bool paired);
   
 #endif
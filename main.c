@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #include "config.h"
@@ -15,8 +16,13 @@
 #include "pm.h"
 #include "write.h"
 #include "leapfrog.h"
+#include "domain.h"
 
-Particles* alloc_particles(const int nc);
+Particles* alloc_particles(const int nc, const bool force);
+#ifdef CHECK_FORCE
+static void check_pm_force(Particles* const particles,
+			   PowerSpectrum* const ps, const int nc);
+#endif
 
 int main(int argc, char* argv[])
 {
@@ -31,9 +37,17 @@ int main(int argc, char* argv[])
   int nc= 64;
   float boxsize= 64.0f;
   const unsigned long seed= 100;
+  const enum LptRandom random= lpt_random_ngenic; // or lpt_random_philox
+  const int lpt_order= 2; // 3 for 3LPT initial positions and velocities
+  const bool lpt_low_memory= false; // 2LPT in 3 instead of 9 meshes
+  const bool fixed_amplitude= false, paired_phase= false;
   const double omega_m= 0.273;
 
   const int nstep= 10;
+  const int sort_interval= 4; // sort particles by PM cell every this steps
+  const int snapshot_interval= 5; // background snapshot every this steps
+  const bool force_kick= true; // PM adds forces to velocities directly;
+                               // no particles->force
 
   const int pm_factor= 3;
   const int nc_pm= pm_factor*nc;
@@ -41,24 +55,54 @@ int main(int argc, char* argv[])
   const float a_init= a_final/nstep;
 
   // Memory management
-  Mem* mem1= mem_init("mem1"); // mainly for density
-  mem_reserve(mem1, 9*fft_mem_size_working(nc, 0), "LPT");
+  Mem* mem1= mem_init("mem1"); // LPT, then the PM density mesh; LPT must
+                               // finish before the first PM step
+  // 3 Psi_i and 6 Psi_ij meshes, or 3 meshes in total for low memory
+  mem_reserve(mem1, (lpt_low_memory ? 3 : 9)*fft_mem_size_working(nc, 1),
+	      "LPT");
   mem_reserve(mem1, fft_mem_size_working(nc_pm, 1), "ParticleMesh");
   mem_alloc_reserved(mem1);
 
   Mem* mem2= mem_init("mem2");
-  mem_reserve(mem2, fft_mem_size_fk(nc_pm, 1), "delta_k");
+  mem_reserve(mem2, fft_mem_size_working(nc_pm, 1), "delta_k");
   mem_alloc_reserved(mem2);
+
+  // Force meshes for the fused force interpolation and the finite-
+  // difference force; one more PM mesh, two with interlacing. Without
+  // them the force is interpolated one axis at a time.
+  Mem* mem3= 0;
+#if defined FUSED_FORCE || defined FINITE_DIFFERENCE
+  mem3= mem_init("mem3");
+  mem_reserve(mem3, pm_mem_size_force(nc_pm), "ForceMesh");
+  mem_alloc_reserved(mem3);
+#endif
   
-  Particles* particles= alloc_particles(nc);
+  // Transpose scratch shared by all pencil FFTs; none for slabs
+  if(fft_mem_size_scratch(nc_pm) > 0) {
+    Mem* mem_scratch= mem_init("mem_scratch");
+    mem_reserve(mem_scratch, fft_mem_size_scratch(nc), "LPT FFT scratch");
+    mem_reserve(mem_scratch, fft_mem_size_scratch(nc_pm), "PM FFT scratch");
+    mem_alloc_reserved(mem_scratch);
+    fft_set_scratch(mem_scratch);
+  }
+
+  // Snapshots in flight may use as much memory as one PM mesh
+  write_set_async_memory(mem2->size_alloc);
+
+  Particles* particles= alloc_particles(nc, !force_kick);
   particles->omega_m= omega_m;
   particles->boxsize= boxsize;
   
   // 2LPT initial condition / displacement
 
   cosmology_init(omega_m);
+  lpt_set_low_memory(lpt_low_memory);
   lpt_init(nc, boxsize, mem1);
-  pm_init(nc_pm, pm_factor, mem1, mem2, boxsize);
+  lpt_set_random(random);
+  lpt_set_order(lpt_order);
+  lpt_set_fixed_paired(fixed_amplitude, paired_phase);
+  pm_init(nc_pm, pm_factor, mem1, mem2, mem3, boxsize);
+  domain_init(nc_pm, boxsize);
 
   //lpt_set_displacements(seed, ps, a_final, particles);
 
@@ -72,6 +116,9 @@ int main(int argc, char* argv[])
   
   lpt_set_displacements(seed, ps, a_init, particles);
   particles->a_v= 1.0/nstep; // origial a_v
+#ifdef CHECK_FORCE
+  check_pm_force(particles, ps, nc);
+#endif
   //leapfrog_set_initial_velocities(particles);
   //write_particles_txt("particle.txt", particles); abort();
 
@@ -79,13 +126,27 @@ int main(int argc, char* argv[])
     float_t a_vel= (istep + 0.5)/nstep;
     float_t a_pos= (istep + 1.0)/nstep;
 
-    pm_compute_forces(particles);
-    cola_kick(particles, a_vel);
-    cola_drift(particles, a_pos);
+    domain_decompose(particles);
+    if(sort_interval > 0 && istep % sort_interval == 0)
+      domain_sort(particles);
+    if(force_kick)
+      pm_compute_forces_kick(particles, cola_force_factor(particles, a_vel));
+    else
+      pm_compute_forces(particles);
+    cola_kick_drift(particles, a_vel, a_pos); // cola_kick + cola_drift
+
+    if(snapshot_interval > 0 && istep % snapshot_interval == 0) {
+      char filename[32];
+      sprintf(filename, "snapshot_%03d.bin", istep);
+      write_snapshot_async(filename, particles); // overlaps the next steps
+    }
 
     //write_particles_txt("particles_drifted.txt", particles, 0); abort();
   }
      
+  write_snapshot("snapshot.bin", particles);
+  write_finalize();
+
   msg_printf(msg_info, "Hello World\n");
 
   /*
@@ -101,15 +162,21 @@ int main(int argc, char* argv[])
   comm_mpi_finalise();
 }
 
-Particles* alloc_particles(const int nc)
+Particles* alloc_particles(const int nc, const bool force)
 {
+  // Particles for nc^3 in total; the force array is optional, see
+  // pm_compute_forces_kick()
   Particles* particles= calloc(sizeof(Particles), 1); assert(particles);
 
   size_t nx= fft_local_nx(nc);
+  size_t ny= fft_local_ny(nc);
   
-  size_t np_alloc= (size_t)((1.25*(nx + 1)*nc*nc));
+  size_t np_alloc= (size_t)((1.25*(nx + 1)*(ny + 1)*nc));
   particles->p= malloc(np_alloc*sizeof(Particle)); assert(particles->p);
-  particles->force= calloc(3*np_alloc, sizeof(float)); assert(particles->force);
+  if(force) {
+    particles->force= calloc(3*np_alloc, sizeof(float));
+    assert(particles->force);
+  }
 
 
   particles->np_allocated= np_alloc;
@@ -119,3 +186,71 @@ Particles* alloc_particles(const int nc)
 
   return particles;
 }
+
+#ifdef CHECK_FORCE
+static void check_pm_force(Particles* const particles,
+			   PowerSpectrum* const ps, const int nc)
+{
+  // Compares the PM power spectrum of the initial particles with the
+  // linear D1^2 P(k), and the PM force with the 2LPT force
+  // -(D1 dx1 + D2a dx2), which COLA subtracts; measures the accuracy of
+  // the mass assignment, interlacing and finite-difference options.
+  // One extra PM step and a temporary force array with force_kick.
+  domain_decompose(particles);
+
+  const double a= particles->a_x;
+  const double growth1= cosmology_D_growth(a);
+
+  // P(k) up to the Nyquist frequency of the particle lattice
+  const int nk= nc/2;
+  double* const pk= malloc(sizeof(double)*3*nk); assert(pk);
+  double* const k= pk + nk;
+  double* const nmode= pk + 2*nk;
+  pm_compute_power_spectrum(particles, nk, k, pk, nmode);
+
+  msg_printf(msg_info, "PM P(k) / linear D1^2 P(k) at a= %.3f\n", a);
+  msg_printf(msg_info, "k [h/Mpc]  P_pm       P_linear   ratio\n");
+  for(int ik=1; ik<nk; ik++) {
+    if(nmode[ik] == 0) continue;
+    const double p_lin= growth1*growth1*power_spectrum(ps, k[ik]);
+    msg_printf(msg_info, "%9.5f  %.3e  %.3e  %.4f\n",
+	       k[ik], pk[ik], p_lin, pk[ik]/p_lin);
+  }
+  free(pk);
+
+  float3* const force= particles->force;
+  if(force == 0) {
+    particles->force= malloc(sizeof(float3)*particles->np_allocated);
+    assert(particles->force);
+  }
+
+  pm_compute_forces(particles);
+
+  const double growth2= cosmology_D2_growth(a, growth1);
+  const double growth2a= cosmology_D2a_growth(growth1, growth2);
+
+  // sum of f_lpt^2, f_lpt*f_pm, and (f_pm - f_lpt)^2
+  double sum[3]= {0.0, 0.0, 0.0};
+  Particle const * const p= particles->p;
+  float3 const * const f= particles->force;
+  for(size_t i=0; i<particles->np_local; i++) {
+    for(int k=0; k<3; k++) {
+      const double f_lpt= -(growth1*particles->dx1_unit[k]*p[i].dx1[k] +
+			    growth2a*particles->dx2_unit[k]*p[i].dx2[k]);
+      sum[0] += f_lpt*f_lpt;
+      sum[1] += f_lpt*f[i][k];
+      sum[2] += (f[i][k] - f_lpt)*(f[i][k] - f_lpt);
+    }
+  }
+  comm_sum_double(sum, 3);
+
+  msg_printf(msg_info, "PM force / 2LPT force at a= %.3f: "
+	     "ratio %.4f, rms error %.4f\n",
+	     a, sum[1]/sum[0], sqrt(sum[2]/sum[0]));
+
+  if(force == 0) {
+    free(particles->force);
+    particles->force= 0;
+  }
+}
+#endif
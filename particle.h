@@ -9,22 +9,97 @@
 #include <stdint.h>
 #include "config.h"
 
+#ifdef COMPACT_LPT
+typedef int16_t dx_t; // LPT displacement in units of Particles dx1/dx2_unit
+#else
+typedef float_t dx_t;
+#endif
+
+#ifdef FIXED_POSITION
+typedef uint32_t pos_t; // position in units of boxsize/2^32; periodic
+#else
+typedef float_t pos_t;
+#endif
+
+#ifdef PACKED_ID
+typedef uint32_t particle_id_t; // lattice index; nc^3 < 2^32
+#else
+typedef uint64_t particle_id_t;
+#endif
+
 typedef struct {
-  float_t  x[3];
+  pos_t    x[3];    // read with pos_to_x() for FIXED_POSITION
   float_t  v[3];
-  float_t  dx1[3];  // 1LPT (ZA) displacement
-  float_t  dx2[3];  // 2LPT displacement
-  uint64_t id;      // Particle index 1,2,3...
+  dx_t     dx1[3];  // 1LPT (ZA) displacement
+  dx_t     dx2[3];  // 2LPT displacement
+  particle_id_t id; // Particle index 1,2,3...; read with particle_id()
 } Particle;
 
 typedef struct {
   Particle* p;
   double a_x, a_v;
   float3* force;
+  float_t dx1_unit[3], dx2_unit[3]; // displacement per dx1, dx2 value;
+                                    // 1 unless COMPACT_LPT
 
   size_t np_local, np_allocated;
   uint64_t np_total;
   double omega_m, boxsize;
 } Particles;
 
+static inline uint64_t particle_id(Particle const * const p)
+{
+  return p->id;
+}
+
+static inline float_t pos_to_x(const pos_t x, const float_t boxsize)
+{
+  // Coordinate 0 <= x < boxsize for FIXED_POSITION; x otherwise
+#ifdef FIXED_POSITION
+  return (float_t)(x*(boxsize/4294967296.0));
+#else
+  return x;
+#endif
+}
+
+static inline pos_t pos_add(const pos_t x, const double dx,
+			    const float_t boxsize)
+{
+  // Position x displaced by dx; the periodic wrap is the uint32 overflow
+  // for FIXED_POSITION
+#ifdef FIXED_POSITION
+  const double d= dx*(4294967296.0/boxsize);
+  return x + (uint32_t)(int64_t)(d >= 0 ? d + 0.5 : d - 0.5);
+#else
+  return x + dx;
+#endif
+}
+
+static inline int pos_index(const pos_t x, const int nc,
+			    const float_t dx_inv)
+{
+  // Mesh index floor(x/dx) of the periodic position x for mesh spacing
+  // dx = boxsize/nc; the top bits of x for FIXED_POSITION
+#ifdef FIXED_POSITION
+  return (int)(((uint64_t) x*nc) >> 32);
+#else
+  int i= (int)(x*dx_inv); // same as floor after the clamp below
+  if(i >= nc) i= nc - 1;  // x*dx_inv can round up to nc
+  if(i < 0) i= 0;
+  return i;
+#endif
+}
+
+static inline dx_t dx_compress(const float_t dx, const float_t unit_inv)
+{
+  // Stored value of displacement dx, rounded to the nearest int16 with
+  // COMPACT_LPT
+#ifdef COMPACT_LPT
+  const float_t d= dx*unit_inv;
+  return (dx_t)(d >= 0 ? (int)(d + 0.5f) : -(int)(0.5f - d));
+#else
+  return dx;
+#endif
+}
+
 #endif
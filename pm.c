@@ -1,5 +1,8 @@
+#include <stdlib.h>
+#include <stdbool.h>
 #include <math.h>
 #include <assert.h>
+#include <mpi.h>
 #include <gsl/gsl_rng.h>
 #include "msg.h"
 #include "mem.h"
@@ -8,13 +11,94 @@
 #include "comm.h"
 #include "particle.h"
 #include "fft.h"
+#include "util.h"
+#include "pm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Mass assignment kernel: 2 (CIC), 3 (TSC), or 4 (PCS)
+// DECONVOLUTION divides the Green's function by the window function W(k)^2
+// of the kernel; off by default.
+// check_pm_force() in main.c (-DCHECK_FORCE) measures the force error
+// against 2LPT: on initial conditions, near the particle lattice,
+// deconvolution amplifies the lattice discreteness several times for any
+// kernel; interlacing reduces the error with or without deconvolution.
+#ifdef MASS_ASSIGNMENT
+#define MA_ORDER MASS_ASSIGNMENT
+#else
+#define MA_ORDER 2
+#endif
+
+#if MA_ORDER < 2 || MA_ORDER > 4
+#error "MASS_ASSIGNMENT must be 2 (CIC), 3 (TSC), or 4 (PCS)"
+#endif
+
+// Interlacing: a second mesh shifted by half a mesh spacing in x, y, z
+// cancels the leading aliasing contributions
+#ifdef INTERLACING
+static const int ngrid= 2;
+#else
+static const int ngrid= 1;
+#endif
 
 static int pm_factor;
 static size_t nc, nzpad;
+static int local_ny, local_iy0; // local y rows; all nc rows for x slabs
 static float_t boxsize;
 
-static FFT* fft_pm;
+static FFT* fft_pm;       // density(x) -> delta(k), out of place
+static FFT* fft_work;     // in-place FFT over the density mesh
+static FFT* fft_force[3]; // three force meshes for the fused interpolation
+
+// Finite-difference force from the potential: 0 (spectral force), 2, or 4
+#ifdef FINITE_DIFFERENCE
+static int fd_points= FINITE_DIFFERENCE;
+#else
+static int fd_points= 0;
+#endif
+static float_t* phi_halo[2]; // x planes of potential from left/right nodes
+static float_t* fd_row;       // nc + 4 periodic z row per thread
+static int fd_nthread;
 static complex_t* delta_k;
+static float_t* window_inv;       // 1/W(k)^2 per axis, or 1
+static float_t* green;            // Green's function G(k) in delta_k layout
+static pm_green_function green_function; // user-supplied G(k), or 0
+static float_t (*phase_half)[2];  // exp(i pi k/nc) per axis, interlacing
+
+// Buffer particle communication
+static int this_node, n_nodes;
+static int *owner_x, *owner_y; // node owning mesh (ix, iy) is the sum
+static int *nsend, *nrecv, *send_displ, *recv_displ;
+static size_t nbuf_alloc;
+static size_t* send_index; // local index of the particle for each copy sent
+static float_t *buf_send, *buf_recv;
+static size_t np_local; // buffer copies are p[np_local ...]
+
+// Streaming kick: velocities get kick times the force as it is
+// interpolated; only the buffer copies keep their force, in buf_force
+static bool kick_stream= false;
+static float_t kick;
+static float3* buf_force;
+
+// OpenMP mass assignment with atomic adds, or in tiles without atomics;
+// -DCIC_TILED makes tiles the default, see pm_set_tiled_assignment()
+#ifdef CIC_TILED
+static bool tiled_assignment= true;
+#else
+static bool tiled_assignment= false;
+#endif
+
+#ifdef _OPENMP
+// Tiles for mass assignment without atomics, allocated on first use
+static int ntile_x, ntile_y;  // number of tiles in x and y; ntile_y even
+static int cic_nthread;       // threads cic_count is allocated for
+static size_t* cic_count;    // tile counts/offsets, per thread
+static size_t* cic_tile_begin;
+static uint32_t* cic_index;  // particle indices sorted by tile
+static size_t cic_index_alloc;
+#endif
 
 static inline void grid_assign(float_t * const d, 
 	    const size_t ix, const size_t iy, const size_t iz, const float_t f)
@@ -22,30 +106,141 @@ static inline void grid_assign(float_t * const d,
 #ifdef _OPENMP
   #pragma omp atomic
 #endif
-  d[(ix*nc + iy)*nzpad + iz] += f;
+  d[(ix*local_ny + iy)*nzpad + iz] += f;
+}
+
+static inline void grid_add(float_t * const d, 
+	    const size_t ix, const size_t iy, const size_t iz, const float_t f)
+{
+  d[(ix*local_ny + iy)*nzpad + iz] += f;
 }
 
 static inline float_t grid_val(float_t const * const d,
 			const size_t ix, const size_t iy, const size_t iz)
 {
-  return d[(ix*nc + iy)*nzpad + iz];
+  return d[(ix*local_ny + iy)*nzpad + iz];
+}
+
+static inline void grid_val3(float_t const * const d[],
+	    const size_t ix, const size_t iy, const size_t iz, const float_t w,
+	    float_t f[])
+{
+  const size_t index= (ix*local_ny + iy)*nzpad + iz;
+  f[0] += w*d[0][index];
+  f[1] += w*d[1][index];
+  f[2] += w*d[2][index];
+}
+
+static inline int periodic_index(const int i)
+{
+  const int n= nc;
+  return i < 0 ? i + n : (i >= n ? i - n : i);
+}
+
+static inline int ma_first_index(const float_t u)
+{
+  // First mesh index of the mass assignment cloud of a particle at u,
+  // in units of the mesh spacing
+#if MA_ORDER == 3
+  return (int) floor(u + 0.5) - 1;
+#else
+  return (int) floor(u) - (MA_ORDER - 2)/2;
+#endif
+}
+
+static inline int ma_weights(const float_t u, float_t w[])
+{
+  // Mass assignment weights w[j] on mesh points ma_first_index(u) + j,
+  // j= 0 ... MA_ORDER - 1. Returns ma_first_index(u).
+#if MA_ORDER == 2
+  // CIC
+  const int i= (int) floor(u);
+  w[1]= u - i;
+  w[0]= 1 - w[1];
+  return i;
+#elif MA_ORDER == 3
+  // TSC
+  const int i= (int) floor(u + 0.5);
+  const float_t d= u - i;
+  w[0]= 0.5*(0.5 - d)*(0.5 - d);
+  w[1]= 0.75 - d*d;
+  w[2]= 0.5*(0.5 + d)*(0.5 + d);
+  return i - 1;
+#else
+  // PCS
+  const int i= (int) floor(u);
+  const float_t t= u - i, s= 1 - t;
+  w[0]= s*s*s/6;
+  w[1]= (4 - 6*t*t + 3*t*t*t)/6;
+  w[2]= (4 - 6*s*s + 3*s*s*s)/6;
+  w[3]= t*t*t/6;
+  return i - 1;
+#endif
+}
+
+static inline int ma_cloud(float_t const * const x, const float_t shift,
+			   const float_t dx_inv, float_t wx[], float_t wy[],
+			   float_t wz[], int iy[], int iz[])
+{
+  // Weights and mesh indices of the mass assignment cloud of a particle
+  // at x on the mesh shifted by shift mesh spacings.
+  // y and z indices are periodic, and y is relative to local_iy0 (outside
+  // 0 ... local_ny - 1 if not local); returns the first global x index.
+  const int ix0= ma_weights(x[0]*dx_inv - shift, wx);
+  const int iy0= ma_weights(x[1]*dx_inv - shift, wy);
+  const int iz0= ma_weights(x[2]*dx_inv - shift, wz);
+
+  for(int j=0; j<MA_ORDER; j++) {
+    iy[j]= periodic_index(iy0 + j) - local_iy0;
+    iz[j]= periodic_index(iz0 + j);
+  }
+
+  return ix0;
+}
+
+static inline void interlace_phase(const size_t ix, const size_t iy,
+				   const size_t iz, float_t ph[])
+{
+  // ph = exp(i pi (kx + ky + kz)/nc), the phase of the mesh shifted by
+  // half a mesh spacing
+  const float_t re= phase_half[ix][0]*phase_half[iy][0]
+                  - phase_half[ix][1]*phase_half[iy][1];
+  const float_t im= phase_half[ix][0]*phase_half[iy][1]
+                  + phase_half[ix][1]*phase_half[iy][0];
+  ph[0]= re*phase_half[iz][0] - im*phase_half[iz][1];
+  ph[1]= re*phase_half[iz][1] + im*phase_half[iz][0];
 }
 
 
 static size_t send_buffer_positions(Particles* const particles);
-static void pm_assign_cic_density(Particles* particles, size_t np);
+static void pm_assign_density(Particles* particles, size_t np,
+			      const float_t shift);
+#ifdef _OPENMP
+static void assign_density_tiled(float_t* const density,
+				 Particle const * const p, const size_t np,
+				 const float_t shift, const float_t dx_inv,
+				 const float_t fac);
+#endif
 static void check_total_density(float_t const * const density);
-static void compute_delta_k(void);
-static void compute_force_mesh(const int k);
+static void compute_delta_k(const int grid);
+static void compute_force_mesh(const int k, FFT* const fft, const int grid);
+static void compute_potential_mesh(const int grid);
+static void compute_force_mesh_fd(void);
+static void compute_green_function(void);
+static void compute_forces(Particles* particles);
 static void force_at_particle_locations(
-		 Particles* const particles, const int np, const int axis);
-static void add_buffer_forces(Particles* const particles, const size_t np);
+		 Particles* const particles, const int np, const int axis,
+		 const int grid);
+static void force_at_particle_locations3(
+		 Particles* const particles, const int np, const int grid);
+static void send_buffer_forces(Particles* const particles, const size_t np);
+static void buffer_reserve(const size_t n);
 
 //
 // Public functions
 //
 void pm_init(const int nc_pm, const int pm_factor_,
-	     Mem* const mem_pm, Mem* const mem_density,
+	     Mem* const mem_pm, Mem* const mem_density, Mem* const mem_force,
 	     const float_t boxsize_)
 {
   msg_printf(msg_verbose, "PM module init\n");
@@ -54,14 +249,136 @@ void pm_init(const int nc_pm, const int pm_factor_,
   nzpad= 2*(nc/2 + 1);
   boxsize= boxsize_;
 
-  const size_t nckz= nc/2 + 1;
-  
+  // The forward FFT writes delta(k) directly to mem_density, which is kept
+  // until all force components are computed; no copy of delta(k)
+  mem_use_from_zero(mem_pm, 0);
+  mem_use_from_zero(mem_density, 0);
+  fft_pm= fft_alloc_out_of_place("PM", nc, mem_pm, mem_density, 1);
+  delta_k= fft_pm->fk;
+  local_ny= fft_pm->local_ny;
+  local_iy0= fft_pm->local_iy0;
+
   mem_use_from_zero(mem_pm, 0);
-  fft_pm= fft_alloc("PM", nc, mem_pm, 1);
+  fft_work= fft_alloc("PM_work", nc, mem_pm, 1);
+
+  // Force meshes for the fused interpolation, if mem_force has space.
+  // The density mesh is free after the forward FFT. Without interlacing,
+  // delta(k) is used only once and the last force component overwrites it
+  // in place; interlacing needs delta(k) twice and one more mesh.
+  const size_t size_force= pm_mem_size_force(nc);
+  if(mem_force && mem_force->size_alloc >= size_force) {
+    mem_use_from_zero(mem_force, 0);
+    if(ngrid == 1) {
+      mem_use_from_zero(mem_density, 0);
+      fft_force[0]= fft_work;
+      fft_force[1]= fft_alloc("Force_y", nc, mem_force, 1);
+      fft_force[2]= fft_alloc("Force_z", nc, mem_density, 1);
+    }
+    else {
+      fft_force[0]= fft_alloc("Force_x", nc, mem_force, 1);
+      fft_force[1]= fft_alloc("Force_y", nc, mem_force, 1);
+      fft_force[2]= fft_work;
+    }
+    msg_printf(msg_info, "Three force meshes for fused force interpolation\n");
+  }
+  else {
+    fft_force[0]= fft_force[1]= fft_force[2]= 0;
+    if(mem_force)
+      msg_printf(msg_warn, "Warning: not enough memory for force meshes, "
+		 "%lu MB < %lu MB required; "
+		 "interpolating forces one axis at a time\n",
+		 mbytes(mem_force->size_alloc), mbytes(size_force));
+  }
+
+  if(fd_points != 0 && fd_points != 2 && fd_points != 4)
+    msg_abort("Error: FINITE_DIFFERENCE must be 2 or 4: %d\n", fd_points);
 
+  if(fd_points && fft_force[0] == 0) {
+    msg_printf(msg_warn, "Warning: finite-difference force requires three "
+	       "force meshes; using spectral force\n");
+    fd_points= 0;
+  }
+
+  if(fd_points && local_ny < (int) nc) {
+    msg_printf(msg_warn, "Warning: finite-difference force requires x "
+	       "slabs; using spectral force\n");
+    fd_points= 0;
+  }
+
+  if(fd_points) {
+    const size_t local_nx= fft_pm->local_nx;
+    if(local_nx > 0 && local_nx < fd_points/2)
+      msg_abort("Error: %d-point finite difference requires %d x planes "
+		"per node; only %lu\n", fd_points, fd_points/2, local_nx);
+
+    for(int i=0; i<2; i++) {
+      phi_halo[i]= malloc(sizeof(float_t)*(fd_points/2)*nc*nzpad);
+      assert(phi_halo[i]);
+    }
+
+#ifdef _OPENMP
+    fd_nthread= omp_get_max_threads();
+#else
+    fd_nthread= 1;
+#endif
+    fd_row= malloc(sizeof(float_t)*(nc + 4)*fd_nthread); assert(fd_row);
+    msg_printf(msg_info, "%d-point finite-difference force\n", fd_points);
+  }
+
+  // Window function deconvolution 1/W(k)^2 per axis with
+  // W(k)= [sin(pi k/nc)/(pi k/nc)]^MA_ORDER for assignment and interpolation
+  const int n= nc;
+  window_inv= malloc(sizeof(float_t)*nc); assert(window_inv);
+  for(int i=0; i<n; i++) {
+#ifdef DECONVOLUTION
+    const int k= i <= n/2 ? i : i - n;
+    const double t= M_PI*k/n;
+    const double w= k == 0 ? 1.0 : sin(t)/t;
+    window_inv[i]= pow(w, -2*MA_ORDER);
+#else
+    window_inv[i]= 1;
+#endif
+  }
+
+  if(ngrid == 2) {
+    phase_half= malloc(sizeof(float_t)*2*nc); assert(phase_half);
+    for(int i=0; i<n; i++) {
+      const int k= i <= n/2 ? i : i - n;
+      phase_half[i][0]= cos(M_PI*k/n);
+      phase_half[i][1]= sin(M_PI*k/n);
+    }
+  }
+
+  const char* ma_name[]= {"", "", "CIC", "TSC", "PCS"};
+  msg_printf(msg_info, "Mass assignment %s%s%s\n", ma_name[MA_ORDER],
+#ifdef DECONVOLUTION
+	     " with deconvolution",
+#else
+	     "",
+#endif
+	     ngrid == 2 ? ", interlaced" : "");
+
+  // Green's function table, computed once
+  const size_t ngreen= nc*fft_pm->local_nky*fft_pm->local_nkz;
+  green= malloc(sizeof(float_t)*ngreen);
+  if(green == 0)
+    msg_abort("Error: unable to allocate Green's function table, %lu MB\n",
+	      mbytes(sizeof(float_t)*ngreen));
+  compute_green_function();
+
+  // Tables of mesh owners for buffer particle communication
+  this_node= comm_this_node();
+  n_nodes= comm_n_nodes();
+
+  owner_x= malloc(sizeof(int)*2*nc); assert(owner_x);
+  owner_y= owner_x + nc;
+  fft_mesh_owners(nc, owner_x, owner_y);
+
+  nsend= malloc(sizeof(int)*4*n_nodes); assert(nsend);
+  nrecv= nsend + n_nodes;
+  send_displ= nrecv + n_nodes;
+  recv_displ= send_displ + n_nodes;
 
-  delta_k= mem_use_from_zero(mem_density,
-			     nc*(fft_pm->local_nky)*nckz*sizeof(complex_t));
   //assert(mem_pm != mem_density);
   //assert(mem_pm->buf != mem_density->buf);
   //assert(mem_pm->buf == fft_pm->fk);
@@ -72,48 +389,283 @@ void pm_compute_forces(Particles* particles)
 {
   // Main routine of this source file
   msg_printf(msg_verbose, "PM force computation...\n");
-  
+  assert(particles->force);
+  kick_stream= false;
+
+  compute_forces(particles);
+}
+
+void pm_compute_forces_kick(Particles* particles, const float_t kick_)
+{
+  // Adds kick_*force to the particle velocities without storing the
+  // force; particles->force is not used and can be 0. kick_ is the
+  // velocity change per unit force, e.g., cola_force_factor()
+  msg_printf(msg_verbose, "PM force computation and kick...\n");
+  kick_stream= true;
+  kick= kick_;
+
+  compute_forces(particles);
+}
+
+size_t pm_mem_size_force(const int nc_pm)
+{
+  // Memory for mem_force in pm_init() for the fused force interpolation
+  return (ngrid == 1 ? 1 : 2)*fft_mem_size_working(nc_pm, 1);
+}
+
+void pm_set_green_function(pm_green_function f)
+{
+  // Replaces the Green's function 1/k^2, or 1/(W(k)^2 k^2) with
+  // DECONVOLUTION, with f(k); f= 0 restores the default.
+  // Call after pm_init().
+  green_function= f;
+  compute_green_function();
+}
+
+void pm_set_tiled_assignment(const bool tiled)
+{
+  // Mass assignment in tiles without atomics (true), or with OpenMP atomic
+  // adds (false, default unless -DCIC_TILED); OpenMP only
+#ifndef _OPENMP
+  if(tiled)
+    msg_printf(msg_warn, "Warning: tiled mass assignment requires OpenMP\n");
+#endif
+  tiled_assignment= tiled;
+}
+
+double pm_time_density_assignment(Particles* particles)
+{
+  // Assigns particles to the density mesh and returns the wall-clock time
+  // of the assignment in seconds; for pm_bench. Buffer particles are
+  // exchanged first but not timed.
+  const size_t np_plus_buffer= send_buffer_positions(particles);
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  const double time0= MPI_Wtime();
+  pm_assign_density(particles, np_plus_buffer, 0.0);
+  double t= MPI_Wtime() - time0;
+
+  comm_max_double(&t, 1);
+  return t;
+}
+
+void pm_compute_power_spectrum(Particles* particles, const int nk,
+			       double k[], double P[], double nmode[])
+{
+  // Power spectrum of the particles on the PM mesh, for accuracy checks.
+  // Bin ik collects modes with |k| nearest to ik in units of 2 pi/boxsize,
+  // 1 <= ik < nk; the assignment window W(k)^2 is divided out.
+  //  Output: k[ik]     mean |k| [h/Mpc]
+  //          P[ik]     mean P(k) [(Mpc/h)^3]
+  //          nmode[ik] number of modes in the bin (0 for ik = 0)
+  // Overwrites the density mesh and delta_k
   size_t np_plus_buffer= send_buffer_positions(particles);
-  pm_assign_cic_density(particles, np_plus_buffer);
-  check_total_density(fft_pm->fx);
 
-  compute_delta_k();
+  for(int grid=0; grid<ngrid; grid++) {
+    pm_assign_density(particles, np_plus_buffer, 0.5*grid);
+    compute_delta_k(grid);
+  }
+
+  for(int ik=0; ik<nk; ik++)
+    k[ik]= P[ik]= nmode[ik]= 0.0;
 
-  for(int axis=0; axis<3; axis++) {
-    // delta(k) -> f(x_i)
-    compute_force_mesh(axis);
+  const size_t nckz= fft_pm->local_nkz;
+  const size_t local_ikz0= fft_pm->local_ikz0;
+  const size_t local_nky= fft_pm->local_nky;
+  const size_t local_iky0= fft_pm->local_iky0;
 
-    force_at_particle_locations(particles, np_plus_buffer, axis);
+  // window W(k)^2 per axis for the assignment kernel
+  double* const w2= malloc(sizeof(double)*nc); assert(w2);
+  for(size_t i=0; i<nc; i++) {
+    const int ki= i <= nc/2 ? i : i - nc;
+    const double t= M_PI*ki/nc;
+    w2[i]= ki == 0 ? 1.0 : pow(sin(t)/t, 2*MA_ORDER);
+  }
 
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    const size_t iy= iy_local + local_iky0;
+    const int ky= iy <= nc/2 ? iy : iy - nc;
 
-    //force_at_particle_locations(particles->p, np_plus_buffer, axes,
-    //(float*) fftdata, particles->force);
+    for(size_t ix=0; ix<nc; ix++) {
+      const int kx= ix <= nc/2 ? ix : ix - nc;
+
+      for(size_t iz_local=0; iz_local<nckz; iz_local++) {
+	const size_t iz= iz_local + local_ikz0;
+	const double kmag= sqrt((double) (kx*kx + ky*ky + iz*iz));
+	const int ik= (int) floor(kmag + 0.5);
+	if(ik == 0 || ik >= nk)
+	  continue;
+
+	// kz > 0 modes stand for their complex conjugates at -kz
+	const double weight= (iz == 0 || 2*iz == nc) ? 1.0 : 2.0;
+	const size_t index= (nc*iy_local + ix)*nckz + iz_local;
+	const double d2= delta_k[index][0]*delta_k[index][0] +
+	                 delta_k[index][1]*delta_k[index][1];
+
+	k[ik] += weight*kmag;
+	P[ik] += weight*d2/(w2[ix]*w2[iy]*w2[iz]);
+	nmode[ik] += weight;
+      }
+    }
+  }
+  free(w2);
+
+  comm_sum_double(k, nk);
+  comm_sum_double(P, nk);
+  comm_sum_double(nmode, nk);
+
+  // P(k) = L^3/N^6 |delta_k|^2 for the unnormalised FFT
+  const double dk= 2.0*M_PI/boxsize;
+  const double n3= (double) nc*nc*nc;
+  const double fac= (double) boxsize*boxsize*boxsize/(n3*n3);
+  for(int ik=1; ik<nk; ik++) {
+    if(nmode[ik] > 0) {
+      k[ik]= dk*k[ik]/nmode[ik];
+      P[ik]= fac*P[ik]/nmode[ik];
+    }
   }
-  add_buffer_forces(particles, np_plus_buffer);
 }
 
-
 //
 // Private (static) functions
 //
 
+void compute_forces(Particles* particles)
+{
+  // Force on particles; stored in particles->force, or added to velocities
+  // with kick_stream
+  size_t np_plus_buffer= send_buffer_positions(particles);
+
+  // grid 1 is the interlaced mesh shifted by half a mesh spacing
+  for(int grid=0; grid<ngrid; grid++) {
+    pm_assign_density(particles, np_plus_buffer, 0.5*grid);
+    check_total_density(fft_pm->fx);
+
+    compute_delta_k(grid);
+  }
+
+  // Forces are averaged over the interlaced meshes
+  for(int grid=0; grid<ngrid; grid++) {
+    if(fd_points) {
+      // delta(k) -> phi(x) -> f(x) with one inverse FFT
+      compute_potential_mesh(grid);
+      compute_force_mesh_fd();
+
+      force_at_particle_locations3(particles, np_plus_buffer, grid);
+    }
+    else if(fft_force[0]) {
+      // delta(k) -> f(x_i) for all axes, then one pass over particles
+      for(int axis=0; axis<3; axis++)
+	compute_force_mesh(axis, fft_force[axis], grid);
+
+      force_at_particle_locations3(particles, np_plus_buffer, grid);
+    }
+    else {
+      for(int axis=0; axis<3; axis++) {
+	// delta(k) -> f(x_i)
+	compute_force_mesh(axis, fft_work, grid);
+
+	force_at_particle_locations(particles, np_plus_buffer, axis, grid);
+      }
+    }
+  }
+  send_buffer_forces(particles, np_plus_buffer);
+}
+
+static inline float_t const * particle_x(Particle const * const p,
+					 const size_t i, float_t x[])
+{
+  // Position of particle i. With FIXED_POSITION, the coordinates are
+  // converted to x, and buffer copies, which can be outside the box, are
+  // read from buf_recv
+#ifdef FIXED_POSITION
+  if(i >= np_local)
+    return buf_recv + 3*(i - np_local);
+
+  for(int k=0; k<3; k++)
+    x[k]= pos_to_x(p[i].x[k], boxsize);
+  return x;
+#else
+  return p[i].x;
+#endif
+}
+
+static inline int buffer_destinations(float_t const * const x,
+				      const float_t dx_inv,
+				      int dest[], float_t shift[])
+{
+  // Returns the number of buffer copies the particle at x needs, and the
+  // destination nodes and x shifts of the copies (at most
+  // (MA_ORDER + 1)^2). The mass assignment clouds on the mesh, and on the
+  // interlaced mesh, cover x planes ix_begin ... ix_end and y rows
+  // iy_begin ... iy_end; y is periodic on the mesh and needs no shift.
+  const float_t shift_grid= 0.5*(ngrid - 1);
+  const int ix_begin= ma_first_index(x[0]*dx_inv - shift_grid);
+  const int ix_end= ma_first_index(x[0]*dx_inv) + MA_ORDER - 1;
+  int iy_begin= 0, iy_end= 0;
+  if(local_ny < (int) nc) {
+    iy_begin= ma_first_index(x[1]*dx_inv - shift_grid);
+    iy_end= ma_first_index(x[1]*dx_inv) + MA_ORDER - 1;
+  }
+  const int n_mesh= nc;
+  int n= 0;
+
+  for(int ix=ix_begin; ix<=ix_end; ix++) {
+    int ixw= ix;
+    float_t sh= 0;
+    if(ix < 0) { // periodic wrapup
+      ixw += n_mesh;
+      sh= boxsize;
+    }
+    else if(ix >= n_mesh) {
+      ixw -= n_mesh;
+      sh= -boxsize;
+    }
+
+    for(int iy=iy_begin; iy<=iy_end; iy++) {
+      const int node= owner_x[ixw] + owner_y[periodic_index(iy)];
+      if(node == this_node && sh == 0)
+	continue; // covered by the particle itself
+
+      int j= 0;
+      while(j < n && !(node == dest[j] && sh == shift[j]))
+	j++;
+      if(j < n)
+	continue; // same copy as another plane
+
+      dest[n]= node;
+      shift[n]= sh;
+      n++;
+    }
+  }
+
+  return n;
+}
+
 size_t send_buffer_positions(Particles* const particles)
 {
+  // Sends copies of the particles near the slab (pencil) edges to the nodes
+  // that own the mesh planes in their mass assignment cloud. Received
+  // buffer particles are placed after the local particles, p[np_local ...]
+  // Returns np_local + number of buffer particles received
   assert(boxsize > 0);
-  // ToDo !!! send with MPI !!!
   const size_t np= particles->np_local;
   Particle* const p= particles->p;
-  const int nbuf= particles->np_allocated;
-  
-  const float_t eps= boxsize/nc;
-  const float_t x_left= eps;
-  const float_t x_right= boxsize - eps;
+  const size_t nbuf= particles->np_allocated;
+  const float_t dx_inv= nc/boxsize;
+  float_t xi[3];
+
+  np_local= np;
 
+  int dest[(MA_ORDER + 1)*(MA_ORDER + 1)];
+  float_t shift[(MA_ORDER + 1)*(MA_ORDER + 1)];
 
-  size_t ibuf= np;
+  for(int i=0; i<n_nodes; i++)
+    nsend[i]= 0;
 
-  // Periodic wrap up and make a buffer copy near x-edges
+  // Periodic wrap up and count the number of buffer copies
   for(size_t i=0; i<np; i++) {
+#ifndef FIXED_POSITION
     if(p[i].x[0] < 0) p[i].x[0] += boxsize;
     else if(p[i].x[0] >= boxsize) p[i].x[0] -= boxsize;
 
@@ -122,51 +674,119 @@ size_t send_buffer_positions(Particles* const particles)
     
     if(p[i].x[2] < 0) p[i].x[2] += boxsize;
     else if(p[i].x[2] >= boxsize) p[i].x[2] -= boxsize;
-    
-    if(p[i].x[0] < x_left) {
-      if(ibuf >= nbuf)
-	msg_abort("Error: not enough space for buffer particles. "
-		  "%lu %lu\n", ibuf, nbuf);
-      
-      p[ibuf].x[0]= p[i].x[0] + boxsize;
-      p[ibuf].x[1]= p[i].x[1];
-      p[ibuf].x[2]= p[i].x[2];
-      p[ibuf].id= p[i].id;
-
-      ibuf++;
-    }
-    else if(p[i].x[0] > x_right) {
-      if(ibuf >= nbuf)
-	msg_abort("Error: not enough space for buffer particles. "
-		  "%ud %ud\n", ibuf, nbuf);
-
-      p[ibuf].x[0]= p[i].x[0] - boxsize;
-      p[ibuf].x[1]= p[i].x[1];
-      p[ibuf].x[2]= p[i].x[2];
-      p[ibuf].id= p[i].id;
-      ibuf++;
-    }
-
 
 #ifdef CHECK
-    if(!(p[i].x[0] >= 0 && p[i].x[0] <= boxsize))
-      printf("%lu %e\n", i, p[i].x[0]);
     assert(p[i].x[0] >= 0 && p[i].x[0] <= boxsize);
     assert(p[i].x[1] >= 0 && p[i].x[1] <= boxsize);
     assert(p[i].x[2] >= 0 && p[i].x[2] <= boxsize);
+#endif
 #endif
 
+    const int n= buffer_destinations(particle_x(p, i, xi), dx_inv,
+				     dest, shift);
+    for(int j=0; j<n; j++)
+      nsend[dest[j]]++;
   }
 
-  return ibuf;
-}
+  MPI_Alltoall(nsend, 1, MPI_INT, nrecv, 1, MPI_INT, MPI_COMM_WORLD);
+
+  size_t nsend_total= 0, nrecv_total= 0;
+  for(int i=0; i<n_nodes; i++) {
+    send_displ[i]= nsend_total;
+    recv_displ[i]= nrecv_total;
+    nsend_total += nsend[i];
+    nrecv_total += nrecv[i];
+  }
+
+  if(np + nrecv_total > nbuf)
+    msg_abort("Error: not enough space for buffer particles. "
+	      "%lu + %lu > %lu\n", np, nrecv_total, nbuf);
+
+  buffer_reserve(nsend_total > nrecv_total ? nsend_total : nrecv_total);
+
+  // Pack positions and remember which particle each copy came from
+  for(int i=0; i<n_nodes; i++)
+    nsend[i]= 0;
+
+  for(size_t i=0; i<np; i++) {
+    float_t const * const x= particle_x(p, i, xi);
+    const int n= buffer_destinations(x, dx_inv, dest, shift);
+    for(int j=0; j<n; j++) {
+      size_t ibuf= send_displ[dest[j]] + nsend[dest[j]]++;
+      send_index[ibuf]= i;
+      buf_send[3*ibuf    ]= x[0] + shift[j];
+      buf_send[3*ibuf + 1]= x[1];
+      buf_send[3*ibuf + 2]= x[2];
+    }
+  }
+
+  // MPI counts in units of float_t
+  for(int i=0; i<n_nodes; i++) {
+    nsend[i] *= 3; send_displ[i] *= 3;
+    nrecv[i] *= 3; recv_displ[i] *= 3;
+  }
 
+  MPI_Alltoallv(buf_send, nsend, send_displ, FLOAT_TYPE,
+		buf_recv, nrecv, recv_displ, FLOAT_TYPE, MPI_COMM_WORLD);
+
+#ifndef FIXED_POSITION
+  for(size_t j=0; j<nrecv_total; j++) {
+    p[np + j].x[0]= buf_recv[3*j    ];
+    p[np + j].x[1]= buf_recv[3*j + 1];
+    p[np + j].x[2]= buf_recv[3*j + 2];
+  }
+#endif
+
+  msg_printf(msg_debug, "%lu buffer particles sent, %lu received\n",
+	     nsend_total, nrecv_total);
+
+  return np + nrecv_total;
+}
 
   
-void pm_assign_cic_density(Particles* particles, size_t np) 
+static inline void assign_particle(float_t* const density,
+				   float_t const * const x, const float_t shift,
+				   const float_t dx_inv, const float_t fac,
+				   const int local_ix0, const int local_nx,
+				   const bool atomic)
+{
+  // Assigns one particle at x to the density mesh shifted by shift
+  // mesh spacings
+  float_t wx[MA_ORDER], wy[MA_ORDER], wz[MA_ORDER];
+  int iy[MA_ORDER], iz[MA_ORDER];
+
+#ifdef CHECK
+  assert(x[1] >= 0 && x[2] >= 0);
+#endif
+
+  // No periodic wrapup in x direction. 
+  // Buffer particles are copied from adjacent nodes, instead
+  const int ix0= ma_cloud(x, shift, dx_inv, wx, wy, wz, iy, iz) - local_ix0;
+
+  void (*assign)(float_t* const, const size_t, const size_t, const size_t,
+		 const float_t)= atomic ? grid_assign : grid_add;
+
+  for(int jx=0; jx<MA_ORDER; jx++) {
+    const int ix= ix0 + jx;
+    if(ix < 0 || ix >= local_nx)
+      continue;
+
+    for(int jy=0; jy<MA_ORDER; jy++) {
+      if(iy[jy] < 0 || iy[jy] >= local_ny)
+	continue;
+
+      const float_t wxy= fac*wx[jx]*wy[jy];
+      for(int jz=0; jz<MA_ORDER; jz++)
+	assign(density, ix, iy[jy], iz[jz], wxy*wz[jz]);
+    }
+  }
+}
+
+void pm_assign_density(Particles* particles, size_t np, const float_t shift) 
 {
   // Input:  particle positions in particles->p.x
-  // Result: density field delta(x) in fft_pm->fx
+  // Result: density field delta(x) in fft_pm->fx on the mesh shifted by
+  //         shift mesh spacings
 
   // particles are assumed to be periodiclly wraped up in y,z direction
   // and np is the number of particles including buffer particles
@@ -175,9 +795,9 @@ void pm_assign_cic_density(Particles* particles, size_t np)
   float_t* const density= (float*) fft_pm->fx;
   Particle* p= particles->p;
   const size_t local_nx= fft_pm->local_nx;
-  const size_t local_ix0= fft_pm->local_ix0;
  
   msg_printf(msg_verbose, "particle position -> density mesh\n");
+  const double time0= MPI_Wtime();
 
   const float_t dx_inv= nc/boxsize;
   
@@ -188,67 +808,33 @@ void pm_assign_cic_density(Particles* particles, size_t np)
   #pragma omp parallel for default(shared)
 #endif
   for(size_t ix = 0; ix < local_nx; ix++)
-    for(size_t iy = 0; iy < nc; iy++)
+    for(size_t iy = 0; iy < local_ny; iy++)
       for(size_t iz = 0; iz < nc; iz++)
-	density[(ix*nc + iy)*nzpad + iz] = -1;
+	density[(ix*local_ny + iy)*nzpad + iz] = -1;
 
 #ifdef _OPENMP
-  #pragma omp parallel for default(shared)
-#endif
-  for(size_t i=0; i<np; i++) {
-    float x=p[i].x[0]*dx_inv;
-    float y=p[i].x[1]*dx_inv;
-    float z=p[i].x[2]*dx_inv;
-
-    //iI, J, K
-    int ix0= (int) floorf(x); // without floor, -1 < X < 0 is mapped to iI=0
-    int iy0= (int) y;         // assuming y,z are positive
-    int iz0= (int) z;
-
-    // CIC weight on left grid
-    float_t wx1= x - ix0; // D1 D2 D3
-    float_t wy1= y - iy0;
-    float_t wz1= z - iz0;
-
-    // CIC weight on right grid
-    float_t wx0= 1 - wx1;    // T1 T2 T3
-    float_t wy0= 1 - wy1;
-    float_t wz0= 1 - wz1;
-
-    //float_tfloat T2W =T2*WPAR;
-    //float D2W =D2*WPAR;
-
-#ifdef CHECK
-    assert(y >= 0.0f && z >= 0.0f);
-#endif
-            
-    // No periodic wrapup in x direction. 
-    // Buffer particles are copied from adjacent nodes, instead
-    if(iy0 >= nc) iy0= 0; 
-    if(iz0 >= nc) iz0= 0;
-
-    // I1 J1 K1
-    int ix1= ix0 + 1;
-    int iy1= iy0 + 1; if(iy1 >= nc) iy1= 0; // assumes y,z < boxsize
-    int iz1= iz0 + 1; if(iz1 >= nc) iz1= 0;
-
-    ix0 -= local_ix0;
-    ix1 -= local_ix0;
-
-    if(0 <= ix0 && ix0 < local_nx) {
-      grid_assign(density, ix0, iy0, iz0, fac*wx0*wy0*wz0); //T3*T1*T2W
-      grid_assign(density, ix0, iy0, iz1, fac*wx0*wy0*wz1); //D3*T1*T2W);
-      grid_assign(density, ix0, iy1, iz0, fac*wx0*wy1*wz0); //T3*T1*D2W);
-      grid_assign(density, ix0, iy1, iz1, fac*wx0*wy1*wz1); //D3*T1*D2W);
+  if(tiled_assignment) {
+    assign_density_tiled(density, p, np, shift, dx_inv, fac);
+  }
+  else {
+    const size_t local_ix0= fft_pm->local_ix0;
+
+    #pragma omp parallel for default(shared)
+    for(size_t i=0; i<np; i++) {
+      float_t xi[3];
+      assign_particle(density, particle_x(p, i, xi), shift, dx_inv, fac,
+		      local_ix0, local_nx, true);
     }
+  }
+#else
+  const size_t local_ix0= fft_pm->local_ix0;
 
-    if(0 <= ix1 && ix1 < local_nx) {
-      grid_assign(density, ix1, iy0, iz0, fac*wx1*wy0*wz0); // T3*D1*T2W);
-      grid_assign(density, ix1, iy0, iz1, fac*wx1*wy0*wz1); // D3*D1*T2W);
-      grid_assign(density, ix1, iy1, iz0, fac*wx1*wy1*wz0); // T3*D1*D2W);
-      grid_assign(density, ix1, iy1, iz1, fac*wx1*wy1*wz1); // D3*D1*D2W);
-    }
+  for(size_t i=0; i<np; i++) {
+    float_t xi[3];
+    assign_particle(density, particle_x(p, i, xi), shift, dx_inv, fac,
+		    local_ix0, local_nx, true);
   }
+#endif
 
   /*
   FILE* fp= fopen("particle.txt", "w");
@@ -270,9 +856,170 @@ void pm_assign_cic_density(Particles* particles, size_t np)
   abort();
   */
   
-  msg_printf(msg_verbose, "CIC density assignment finished.\n");
+  // pm_bench compares the tiled and atomic assignments
+#ifdef _OPENMP
+  const char* const method= tiled_assignment ? "tiled" : "atomic";
+  const int nthread= omp_get_max_threads();
+#else
+  const char* const method= "serial";
+  const int nthread= 1;
+#endif
+  msg_printf(msg_verbose, "Density assignment finished. %.3f sec; "
+	     "%s, %d threads, %lu particles\n",
+	     MPI_Wtime() - time0, method, nthread, np);
 }
 
+#ifdef _OPENMP
+static void tile_init(void)
+{
+  // Tiles of MA_ORDER - 1 x planes and about 4 y rows; the number of tiles
+  // in y must be even so that tiles of the same parity are not adjacent
+  // across the periodic boundary. Pencils are tiled in y like x slabs.
+  if(local_ny == (int) nc) {
+    ntile_y= nc/4;
+    ntile_y -= ntile_y % 2;
+    if(ntile_y < 2) ntile_y= 2;
+    if(nc/ntile_y < MA_ORDER - 1)
+      msg_abort("Error: PM mesh too small for tiled mass assignment\n");
+  }
+  else {
+    ntile_y= (local_ny + MA_ORDER - 2)/(MA_ORDER - 1) + 1;
+    if(local_ny + MA_ORDER - 1 > (int) nc)
+      msg_abort("Error: PM mesh too small for tiled mass assignment\n");
+  }
+
+  ntile_x= (fft_pm->local_nx + MA_ORDER - 2)/(MA_ORDER - 1) + 1;
+  const int ntile= ntile_x*ntile_y;
+  cic_nthread= omp_get_max_threads();
+  free(cic_count);
+  free(cic_tile_begin);
+  cic_count= malloc(sizeof(size_t)*ntile*cic_nthread);
+  cic_tile_begin= malloc(sizeof(size_t)*(ntile + 1));
+  assert(cic_count && cic_tile_begin);
+}
+
+static inline int particle_tile(float_t const * const x, const float_t shift,
+				const float_t dx_inv,
+				const int local_ix0, const int local_nx)
+{
+  // Tile index ix_tile*ntile_y + iy_tile of the first mesh point of the
+  // mass assignment cloud, or -1 if the particle does not contribute to
+  // this x-slab (pencil). Tiles are MA_ORDER - 1 x planes wide, and also
+  // MA_ORDER - 1 y rows for pencils.
+  const int ix= ma_first_index(x[0]*dx_inv - shift) - local_ix0
+                + (MA_ORDER - 1);
+  if(ix < 0 || ix >= local_nx + MA_ORDER - 1)
+    return -1;
+
+  const int iy0= periodic_index(ma_first_index(x[1]*dx_inv - shift));
+  if(local_ny == (int) nc)
+    return (ix/(MA_ORDER - 1))*ntile_y + iy0*ntile_y/nc;
+
+  // clouds starting at -(MA_ORDER - 1) ... local_ny - 1 relative to
+  // local_iy0, with periodic wrapup
+  int iy= periodic_index(iy0 - local_iy0);
+  if(iy >= (int) nc - (MA_ORDER - 1))
+    iy -= nc;
+  iy += MA_ORDER - 1;
+  if(iy >= local_ny + MA_ORDER - 1)
+    return -1;
+
+  return (ix/(MA_ORDER - 1))*ntile_y + iy/(MA_ORDER - 1);
+}
+
+void assign_density_tiled(float_t* const density, Particle const * const p,
+			  const size_t np, const float_t shift,
+			  const float_t dx_inv, const float_t fac)
+{
+  // Contention-free mass assignment
+  // Particles are sorted into tiles of MA_ORDER - 1 x planes times
+  // nc/ntile_y y rows by a stable parallel counting sort. The mass
+  // assignment clouds of two tiles never overlap if the tiles differ by 2
+  // or more in x or y, therefore tiles of the same parity (colour) are
+  // assigned in parallel without atomics, one colour after another. Every
+  // mesh cell receives its contributions in the same order for any
+  // number of threads.
+  if(cic_count == 0 || omp_get_max_threads() > cic_nthread)
+    tile_init();
+
+  const int local_ix0= fft_pm->local_ix0;
+  const int local_nx= fft_pm->local_nx;
+  const int ntile= ntile_x*ntile_y;
+
+  // 4-byte indices; buffer particles included
+  if(np > UINT32_MAX)
+    msg_abort("Error: too many particles for tiled mass assignment %lu\n",
+	      np);
+
+  if(np > cic_index_alloc) {
+    cic_index_alloc= (size_t)(1.25*np);
+    if(cic_index_alloc > UINT32_MAX) cic_index_alloc= UINT32_MAX;
+    free(cic_index);
+    cic_index= malloc(sizeof(uint32_t)*cic_index_alloc);
+    if(cic_index == 0)
+      msg_abort("Error: unable to allocate tile index for %lu particles\n",
+		cic_index_alloc);
+  }
+
+  #pragma omp parallel default(shared)
+  {
+    const int nthread= omp_get_num_threads();
+    size_t* const count= cic_count + omp_get_thread_num()*ntile;
+    for(int t=0; t<ntile; t++)
+      count[t]= 0;
+
+    // Same static schedule for counting and filling; each thread fills
+    // its own contiguous range of particles.
+    #pragma omp for schedule(static)
+    for(size_t i=0; i<np; i++) {
+      float_t xi[3];
+      int t= particle_tile(particle_x(p, i, xi), shift, dx_inv,
+			   local_ix0, local_nx);
+      if(t >= 0) count[t]++;
+    }
+
+    #pragma omp single
+    {
+      // offsets ordered by (tile, thread) keep the particle order in tiles
+      size_t n= 0;
+      for(int t=0; t<ntile; t++) {
+	cic_tile_begin[t]= n;
+	for(int j=0; j<nthread; j++) {
+	  size_t c= cic_count[j*ntile + t];
+	  cic_count[j*ntile + t]= n;
+	  n += c;
+	}
+      }
+      cic_tile_begin[ntile]= n;
+    }
+
+    #pragma omp for schedule(static)
+    for(size_t i=0; i<np; i++) {
+      float_t xi[3];
+      int t= particle_tile(particle_x(p, i, xi), shift, dx_inv,
+			   local_ix0, local_nx);
+      if(t >= 0) cic_index[count[t]++]= i;
+    }
+
+    for(int colour=0; colour<4; colour++) {
+      #pragma omp for schedule(dynamic)
+      for(int t=0; t<ntile; t++) {
+	const int tx= t/ntile_y;
+	const int ty= t - tx*ntile_y;
+	if((tx & 1) != (colour & 1) || (ty & 1) != (colour >> 1))
+	  continue;
+
+	for(size_t j=cic_tile_begin[t]; j<cic_tile_begin[t+1]; j++) {
+	  float_t xi[3];
+	  assign_particle(density, particle_x(p, cic_index[j], xi), shift,
+			  dx_inv, fac, local_ix0, local_nx, false);
+	}
+      }
+    }
+  }
+}
+#endif
+
 void check_total_density(float_t const * const density)
 {
   // Checks <delta> = 0
@@ -281,9 +1028,9 @@ void check_total_density(float_t const * const density)
   const size_t local_nx= fft_pm->local_nx;
   
   for(size_t ix = 0; ix < local_nx; ix++)
-    for(size_t iy = 0; iy < nc; iy++)
+    for(size_t iy = 0; iy < local_ny; iy++)
       for(size_t iz = 0; iz < nc; iz++)
-	sum += density[(ix*nc + iy)*nzpad + iz];
+	sum += density[(ix*local_ny + iy)*nzpad + iz];
 
   double sum_global;
   MPI_Reduce(&sum, &sum_global, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
@@ -302,21 +1049,29 @@ void check_total_density(float_t const * const density)
 }
 
 
-void compute_delta_k(void)
+void compute_delta_k(const int grid)
 {
-  // Fourier transform delta(x) -> delta(k) and copy it to delta_k
+  // Fourier transform delta(x) -> delta(k)
   //  Input:  delta(x) in fft_pm->fx
-  //  Output: delta(k) in delta_k
+  //  Output: delta(k) in delta_k == fft_pm->fk, written by the out-of-place
+  //          FFT without a copy
+  //  grid 1 (interlaced) is transformed in place, shifted back by half a
+  //  mesh spacing, and averaged with grid 0 in delta_k
 
   msg_printf(msg_verbose, "delta(x) -> delta(k)\n");
-  fft_execute_forward(fft_pm);
+  if(grid == 0) {
+    fft_execute_forward(fft_pm);
+    return;
+  }
 
-  // Copy density(k) in fft_pm to density_k
-  // because FFT requires twice larger RAM for working memory
-  const size_t nckz= nc/2 + 1;
+  fft_execute_forward(fft_work);
+
+  const size_t nckz= fft_pm->local_nkz;
+  const size_t local_ikz0= fft_pm->local_ikz0;
   const size_t local_nky= fft_pm->local_nky;
+  const size_t local_iky0= fft_pm->local_iky0;
 
-  complex_t* pm_k= fft_pm->fk;
+  complex_t const * const pm_k= fft_work->fk;
   
 #ifdef _OPENMP
   #pragma omp parallel for default(shared)
@@ -325,33 +1080,30 @@ void compute_delta_k(void)
     for(size_t ix=0; ix<nc; ix++) {
       for(size_t iz=0; iz<nckz; iz++){
 	size_t index= (nc*iy + ix)*nckz + iz;
-	delta_k[index][0]= pm_k[index][0];
-	delta_k[index][1]= pm_k[index][1];
-	
-	//printf("%e %e\n", pm_k[index][0], pm_k[index][1]);
+
+	// delta_k = (delta_k + delta_shifted(k) exp(-i pi (kx+ky+kz)/nc))/2
+	float_t ph[2];
+	interlace_phase(ix, iy + local_iky0, iz + local_ikz0, ph);
+	delta_k[index][0]= 0.5*(delta_k[index][0] +
+				pm_k[index][0]*ph[0] + pm_k[index][1]*ph[1]);
+	delta_k[index][1]= 0.5*(delta_k[index][1] +
+				pm_k[index][1]*ph[0] - pm_k[index][0]*ph[1]);
       }
     }
   }
 }
 
-void compute_force_mesh(const int axis)
+void compute_green_function(void)
 {
-  // Calculate one component of force mesh from precalculated density(k)
-  //   Input:   delta(k)   mesh delta_k
-  //   Output:  force_i(k) mesh fft_pm->fx
-
-  complex_t* const fk= fft_pm->fk;
-  
-  //k=0 zero mode force is zero
-  fk[0][0]= 0;
-  fk[0][1]= 0;
-
-  const float_t f1= -1.0/pow(nc, 3.0)/(2.0*M_PI/boxsize);
-  const size_t nckz=nc/2+1;
+  // Tabulates G(k) in the transposed layout of delta_k so that the
+  // k-space passes are streaming multiplies. k is in units of 2 pi/boxsize.
+  //   default: G(k) = 1/(W(kx) W(ky) W(kz))^2 k^2, G(0) = 0, where
+  //   W = 1 without DECONVOLUTION
+  const size_t nckz= fft_pm->local_nkz;
+  const size_t local_ikz0= fft_pm->local_ikz0;
   const size_t local_nky= fft_pm->local_nky;
   const size_t local_iky0= fft_pm->local_iky0;
 
-
 #ifdef _OPENMP
 #pragma omp parallel for default(shared)
 #endif
@@ -366,17 +1118,94 @@ void compute_force_mesh(const int axis)
       int ix0= ix <= (nc/2) ? ix : ix - nc;
       k[0]= (float_t) ix0;
 
-      int kzmin= (ix==0 && iy==0); // skip (0,0,0) to avoid zero division
-
-      for(size_t iz=kzmin; iz<nckz; iz++){
+      for(size_t iz_local=0; iz_local<nckz; iz_local++) {
+	const size_t iz= iz_local + local_ikz0;
 	k[2]= (float_t) iz;
+	size_t index= (nc*iy_local + ix)*nckz + iz_local;
+
+	if(ix == 0 && iy == 0 && iz == 0)
+	  green[index]= 0; // zero mode
+	else if(green_function)
+	  green[index]= green_function(k);
+	else
+	  green[index]= window_inv[ix]*window_inv[iy]*window_inv[iz]/
+	                (k[0]*k[0] + k[1]*k[1] + k[2]*k[2]);
+      }
+    }
+  }
+}
+
+static inline void interlace_row(complex_t* const f, const size_t ix,
+				 const size_t iy, const size_t iz0,
+				 const size_t nz)
+{
+  // Multiplies a row f[iz] of the k-space mesh, kz = iz0 + iz, by the phase
+  // of the grid shifted by half a mesh spacing, exp(i pi (kx + ky + kz)/nc)
+  for(size_t iz=0; iz<nz; iz++) {
+    float_t ph[2];
+    interlace_phase(ix, iy, iz0 + iz, ph);
+    const float_t re= f[iz][0]*ph[0] - f[iz][1]*ph[1];
+    f[iz][1]= f[iz][0]*ph[1] + f[iz][1]*ph[0];
+    f[iz][0]= re;
+  }
+}
+
+void compute_force_mesh(const int axis, FFT* const fft, const int grid)
+{
+  // Calculate one component of force mesh from precalculated density(k)
+  //   Input:   delta(k)   mesh delta_k
+  //   Output:  force_i(k) mesh fft->fx, divided by the number of meshes
+  //            ngrid, on grid 0 or 1
+  //
+  // f_i(k) = i f1 k_i G(k) delta(k), with the Green's function table G
+  // (zero for k=0); the loop over iz is a streaming multiply.
+  // fft->fk can be delta_k itself for the last force component.
+
+  complex_t* const fk= fft->fk;
+  
+  const float_t f1= -1.0/pow(nc, 3.0)/(2.0*M_PI/boxsize)/ngrid;
+  const size_t nckz= fft_pm->local_nkz;
+  const size_t local_ikz0= fft_pm->local_ikz0;
+  const size_t local_nky= fft_pm->local_nky;
+  const size_t local_iky0= fft_pm->local_iky0;
+
+
+#ifdef _OPENMP
+#pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    int iy= iy_local + local_iky0;
+    int iy0= iy <= (nc/2) ? iy : iy - nc;
 
-	float f2= f1/(k[0]*k[0] + k[1]*k[1] + k[2]*k[2])*k[axis];
+    for(size_t ix=0; ix<nc; ix++) {
+      int ix0= ix <= (nc/2) ? ix : ix - nc;
 
-	size_t index= (nc*iy_local + ix)*nckz + iz;
-	fk[index][0]= -f2*delta_k[index][1];
-	fk[index][1]=  f2*delta_k[index][0];
+      const size_t index0= (nc*iy_local + ix)*nckz;
+      float_t const * const g= green + index0;
+      complex_t const * const d= delta_k + index0;
+      complex_t* const f= fk + index0;
+
+      if(axis == 2) {
+	const int nz= nckz, iz0= local_ikz0;
+	for(int iz=0; iz<nz; iz++) {
+	  const float_t f2= f1*(iz0 + iz)*g[iz];
+	  const float_t d0= d[iz][0], d1= d[iz][1];
+	  f[iz][0]= -f2*d1;
+	  f[iz][1]=  f2*d0;
+	}
+      }
+      else {
+	const float_t fxy= f1*(axis == 0 ? ix0 : iy0);
+	for(size_t iz=0; iz<nckz; iz++) {
+	  const float_t f2= fxy*g[iz];
+	  const float_t d0= d[iz][0], d1= d[iz][1];
+	  f[iz][0]= -f2*d1;
+	  f[iz][1]=  f2*d0;
+	}
       }
+
+      if(grid == 1)
+	interlace_row(f, ix, iy, local_ikz0, nckz);
     }
   }
 
@@ -398,98 +1227,330 @@ void compute_force_mesh(const int axis)
   abort();
   */
 
-  fft_execute_inverse(fft_pm); // f_k -> f(x)
+  fft_execute_inverse(fft); // f_k -> f(x)
+}
+
+void compute_potential_mesh(const int grid)
+{
+  // Potential mesh for the finite-difference forces
+  //   Input:  delta(k) mesh delta_k
+  //   Output: phi(x) in fft_force[2]->fx, divided by the number of meshes
+  //           ngrid, on grid 0 or 1; grad phi is the force in
+  //           compute_force_mesh_fd(). Without interlacing fft_force[2]
+  //           overwrites delta_k in place.
+  complex_t* const fk= fft_force[2]->fk;
+  
+  const float_t f1= -1.0/pow(nc, 3.0)/pow(2.0*M_PI/boxsize, 2.0)/ngrid;
+  const size_t nckz= fft_pm->local_nkz;
+  const size_t local_ikz0= fft_pm->local_ikz0;
+  const size_t local_nky= fft_pm->local_nky;
+  const size_t local_iky0= fft_pm->local_iky0;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(shared)
+#endif
+  for(size_t iy_local=0; iy_local<local_nky; iy_local++) {
+    int iy= iy_local + local_iky0;
+
+    for(size_t ix=0; ix<nc; ix++) {
+      const size_t index0= (nc*iy_local + ix)*nckz;
+      float_t const * const g= green + index0;
+      complex_t const * const d= delta_k + index0;
+      complex_t* const f= fk + index0;
+
+      for(size_t iz=0; iz<nckz; iz++) {
+	const float_t f2= f1*g[iz];
+	f[iz][0]= f2*d[iz][0];
+	f[iz][1]= f2*d[iz][1];
+      }
+
+      if(grid == 1)
+	interlace_row(f, ix, iy, local_ikz0, nckz);
+    }
+  }
+
+  fft_execute_inverse(fft_force[2]); // phi_k -> phi(x)
 }
 
-// Does 3-linear interpolation
-// particles= Values of mesh at particle positions P.x
+static void exchange_potential_halo(void)
+{
+  // Copies fd_points/2 x-planes of phi from both neighbouring slabs
+  // to phi_halo[0] (left) and phi_halo[1] (right)
+  const int h= fd_points/2;
+  const size_t nplane= nc*nzpad;
+  const size_t local_nx= fft_pm->local_nx;
+  const size_t local_ix0= fft_pm->local_ix0;
+  float_t* const phi= fft_force[2]->fx;
+
+  int left= MPI_PROC_NULL, right= MPI_PROC_NULL;
+  if(local_nx > 0) {
+    left= owner_x[(local_ix0 + nc - 1) % nc];
+    right= owner_x[(local_ix0 + local_nx) % nc];
+  }
+
+  // first planes -> left neighbour's right halo
+  MPI_Sendrecv(phi, h*nplane, FLOAT_TYPE, left, 0,
+	       phi_halo[1], h*nplane, FLOAT_TYPE, right, 0,
+	       MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+  // last planes -> right neighbour's left halo
+  MPI_Sendrecv(phi + (local_nx - h)*nplane, h*nplane, FLOAT_TYPE, right, 1,
+	       phi_halo[0], h*nplane, FLOAT_TYPE, left, 1,
+	       MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+static inline float_t const * phi_plane(const int ix)
+{
+  // x plane ix of phi, -h <= ix < local_nx + h, including the halo
+  const int h= fd_points/2;
+  const int local_nx= fft_pm->local_nx;
+  const size_t nplane= nc*nzpad;
+
+  if(ix < 0)
+    return phi_halo[0] + (ix + h)*nplane;
+  else if(ix >= local_nx)
+    return phi_halo[1] + (ix - local_nx)*nplane;
+
+  return fft_force[2]->fx + ix*nplane;
+}
+
+void compute_force_mesh_fd(void)
+{
+  // Force = grad phi with 2-point or 4-point finite difference
+  //   Input:  phi(x) in fft_force[2]->fx
+  //   Output: force meshes fft_force[]->fx
+  //
+  // Transfer function relative to the exact gradient, with t= k dx,
+  //   2-point: sin(t)/t,                      0.83 at t=pi/3
+  //   4-point: (8 sin(t) - sin(2t))/(6t),     0.96 at t=pi/3
+  // t= pi/3 is the particle Nyquist frequency for pm_factor= 3.
+  // The smoothing suppresses lattice discreteness; the rms force error
+  // against 2LPT in check_pm_force() is lower than the spectral force's.
+  const size_t local_nx= fft_pm->local_nx;
+  const size_t nplane= nc*nzpad;
+  const float_t dx_inv= nc/boxsize;
+  const float_t c1= fd_points == 2 ? 0.5*dx_inv : 8.0/12.0*dx_inv;
+  const float_t c2= fd_points == 2 ? 0.0        : -1.0/12.0*dx_inv;
+
+  exchange_potential_halo();
+
+  float_t* const fx= fft_force[0]->fx;
+  float_t* const fy= fft_force[1]->fx;
+  
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)
+#endif
+  for(int ix=0; ix<(int)local_nx; ix++) {
+    float_t const * const phi0= phi_plane(ix);
+    float_t const * const phi_m1= phi_plane(ix - 1);
+    float_t const * const phi_p1= phi_plane(ix + 1);
+    float_t const * const phi_m2= c2 != 0 ? phi_plane(ix - 2) : phi0;
+    float_t const * const phi_p2= c2 != 0 ? phi_plane(ix + 2) : phi0;
+
+    for(size_t iy=0; iy<nc; iy++) {
+      const size_t iy_m1= (iy + nc - 1) % nc, iy_p1= (iy + 1) % nc;
+      const size_t iy_m2= (iy + nc - 2) % nc, iy_p2= (iy + 2) % nc;
+
+      for(size_t iz=0; iz<nc; iz++) {
+	size_t index= ix*nplane + iy*nzpad + iz;
+	size_t i= iy*nzpad + iz;
+	fx[index]= c1*(phi_p1[i] - phi_m1[i]) + c2*(phi_p2[i] - phi_m2[i]);
+	fy[index]= c1*(phi0[iy_p1*nzpad + iz] - phi0[iy_m1*nzpad + iz])
+	         + c2*(phi0[iy_p2*nzpad + iz] - phi0[iy_m2*nzpad + iz]);
+      }
+    }
+  }
+
+  // z derivative in place; phi is no longer needed
+  float_t* const fz= fft_force[2]->fx;
+
+#ifdef _OPENMP
+  #pragma omp parallel default(shared)
+#endif
+  {
+#ifdef _OPENMP
+    const int ithread= omp_get_thread_num();
+#else
+    const int ithread= 0;
+#endif
+    assert(ithread < fd_nthread);
+    float_t* const row= fd_row + (nc + 4)*ithread;
+
+#ifdef _OPENMP
+    #pragma omp for
+#endif
+    for(size_t ixy=0; ixy<local_nx*nc; ixy++) {
+      float_t* const f= fz + ixy*nzpad;
+
+      // row[iz + 2] = phi[iz] with periodic wrapup
+      for(size_t iz=0; iz<nc; iz++)
+	row[iz + 2]= f[iz];
+      row[0]= f[(nc*2 - 2) % nc]; row[1]= f[nc - 1];
+      row[nc + 2]= f[0]; row[nc + 3]= f[1 % nc];
+      
+      for(size_t iz=0; iz<nc; iz++)
+	f[iz]= c1*(row[iz + 3] - row[iz + 1]) + c2*(row[iz + 4] - row[iz]);
+    }
+  }
+}
+
+static inline void set_force(Particles* const particles, const size_t i,
+			     const int axis, const float_t fi, const int grid)
+{
+  // Force component fi on particle i from grid; set for grid 0 and added
+  // for grid 1. With kick_stream, the kick is applied directly for local
+  // particles, and buffer copies keep the force for send_buffer_forces()
+  if(kick_stream) {
+    if(i < np_local)
+      particles->p[i].v[axis] += kick*fi;
+    else if(grid == 0)
+      buf_force[i - np_local][axis]= fi;
+    else
+      buf_force[i - np_local][axis] += fi;
+  }
+  else if(grid == 0)
+    particles->force[i][axis]= fi;
+  else
+    particles->force[i][axis] += fi;
+}
+
+// Interpolates the force mesh to particle positions with the mass
+// assignment kernel; the force is set for grid 0 and added for grid 1
 void force_at_particle_locations(Particles* const particles, const int np, 
-				 const int axis)
+				 const int axis, const int grid)
 {
   const Particle* p= particles->p;
   
   const float_t dx_inv= nc/boxsize;
-  const size_t local_nx= fft_pm->local_nx;
-  const size_t local_ix0= fft_pm->local_ix0;
-  const float_t* fx= fft_pm->fx;
-  float3* f= particles->force;
+  const float_t shift= 0.5*grid;
+  const int local_nx= fft_pm->local_nx;
+  const int local_ix0= fft_pm->local_ix0;
+  const float_t* fx= fft_work->fx;
   
 #ifdef _OPENMP
   #pragma omp parallel for default(shared)     
 #endif
   for(size_t i=0; i<np; i++) {
-    float_t x=p[i].x[0]*dx_inv;
-    float_t y=p[i].x[1]*dx_inv;
-    float_t z=p[i].x[2]*dx_inv;
-            
-    int ix0= (int) floorf(x); /// iI !!! floor for double?
-    int iy0= (int) y; //J
-    int iz0= (int) z;   //K
-    
-    float_t wx1= x - ix0; //D1
-    float_t wy1= y - iy0; //D2
-    float_t wz1= z - iz0; //D3
-
-    float_t wx0= 1 - wx1; // T1
-    float_t wy0= 1 - wy1; // T2
-    float_t wz0= 1 - wz1; // T3
-
-    if(iy0 >= nc) iy0= 0;
-    if(iz0 >= nc) iz0= 0;
-            
-    int ix1= ix0 + 1;  // I1
-    int iy1= iy0 + 1; if(iy1 >= nc) iy1= 0; // J1
-    int iz1= iz0 + 1; if(iz1 >= nc) iz1= 0; // K1
-
-    ix0 -= local_ix0;
-    ix1 -= local_ix0;
-
-    f[i][axis]= 0;
-
-    if(0 <= ix0 && ix0 < local_nx) {
-      f[i][axis] += 
-	grid_val(fx, ix0, iy0, iz0)*wx0*wy0*wz0 +
-	grid_val(fx, ix0, iy0, iz1)*wx0*wy0*wz1 +
-	grid_val(fx, ix0, iy1, iz0)*wx0*wy1*wz0 +
-	grid_val(fx, ix0, iy1, iz1)*wx0*wy1*wz1;
-    }
-    if(0 <= ix1 && ix1 < local_nx) {
-      f[i][axis] += 
-	grid_val(fx, ix1, iy0, iz0)*wx1*wy0*wz0 +
-	grid_val(fx, ix1, iy0, iz1)*wx1*wy0*wz1 +
-	grid_val(fx, ix1, iy1, iz0)*wx1*wy1*wz0 +
-	grid_val(fx, ix1, iy1, iz1)*wx1*wy1*wz1;
+    float_t wx[MA_ORDER], wy[MA_ORDER], wz[MA_ORDER];
+    int iy[MA_ORDER], iz[MA_ORDER];
+    float_t xi[3];
+    const int ix0= ma_cloud(particle_x(p, i, xi), shift, dx_inv,
+			    wx, wy, wz, iy, iz) - local_ix0;
+
+    float_t fi= 0;
+    for(int jx=0; jx<MA_ORDER; jx++) {
+      const int ix= ix0 + jx;
+      if(ix < 0 || ix >= local_nx)
+	continue;
+
+      for(int jy=0; jy<MA_ORDER; jy++) {
+	if(iy[jy] < 0 || iy[jy] >= local_ny)
+	  continue;
+
+	const float_t wxy= wx[jx]*wy[jy];
+	for(int jz=0; jz<MA_ORDER; jz++)
+	  fi += grid_val(fx, ix, iy[jy], iz[jz])*wxy*wz[jz];
+      }
     }
+
+    set_force(particles, i, axis, fi, grid);
   }
   
 }
 
-void add_buffer_forces(Particles* const particles, const size_t np)
+// Interpolates all three force components in one pass over the particles;
+// the weights are computed once per particle
+void force_at_particle_locations3(Particles* const particles, const int np,
+				  const int grid)
 {
-  // !! Non-MPI version
-  Particle* const p= particles->p;
+  const Particle* p= particles->p;
   
-  const int np_local= particles->np_local;
-  float3* const force= particles->force;
+  const float_t dx_inv= nc/boxsize;
+  const float_t shift= 0.5*grid;
+  const int local_nx= fft_pm->local_nx;
+  const int local_ix0= fft_pm->local_ix0;
+  float_t const * const fx[]= {fft_force[0]->fx, fft_force[1]->fx,
+			       fft_force[2]->fx};
+  
+#ifdef _OPENMP
+  #pragma omp parallel for default(shared)     
+#endif
+  for(size_t i=0; i<np; i++) {
+    float_t wx[MA_ORDER], wy[MA_ORDER], wz[MA_ORDER];
+    int iy[MA_ORDER], iz[MA_ORDER];
+    float_t xi[3];
+    const int ix0= ma_cloud(particle_x(p, i, xi), shift, dx_inv,
+			    wx, wy, wz, iy, iz) - local_ix0;
+
+    float_t fi[3]= {0, 0, 0};
+    for(int jx=0; jx<MA_ORDER; jx++) {
+      const int ix= ix0 + jx;
+      if(ix < 0 || ix >= local_nx)
+	continue;
+
+      for(int jy=0; jy<MA_ORDER; jy++) {
+	if(iy[jy] < 0 || iy[jy] >= local_ny)
+	  continue;
+
+	const float_t wxy= wx[jx]*wy[jy];
+	for(int jz=0; jz<MA_ORDER; jz++)
+	  grid_val3(fx, ix, iy[jy], iz[jz], wxy*wz[jz], fi);
+      }
+    }
 
-  for(int j=np_local; j<np; j++) {
-    size_t i= p[j].id - 1;
-    assert(p[i].id == p[j].id);
-    force[i][0] += force[j][0];
-    force[i][1] += force[j][1];
-    force[i][2] += force[j][2];
+    for(int k=0; k<3; k++)
+      set_force(particles, i, k, fi[k], grid);
   }
-
-  /*
-  FILE* fp= fopen("force.txt", "w");
-  for(size_t i = 0; i < particles->np_local; i++)
-    fprintf(fp, "%e %e %e\n", force[i][0], force[i][1], force[i][2]);
-  fclose(fp);
-  printf("force.txt written\n");
-  abort();
-  */
-
 }
 
+void send_buffer_forces(Particles* const particles, const size_t np)
+{
+  // Sends the forces on buffer particles back to the nodes they came from
+  // and adds them to the original particles.
+  // Reverse of send_buffer_positions(); counts and displacements are reused.
+  // With kick_stream, the forces are from buf_force and go to velocities
+  float3* const force= particles->force;
+  Particle* const p= particles->p;
 
+  size_t nsend_total= 0;
+  for(int i=0; i<n_nodes; i++)
+    nsend_total += nsend[i];
+  nsend_total /= 3;
+
+  MPI_Alltoallv(kick_stream ? buf_force : force + np_local,
+		nrecv, recv_displ, FLOAT_TYPE,
+		buf_send, nsend, send_displ, FLOAT_TYPE, MPI_COMM_WORLD);
+
+  // send_index can contain the same particle twice; no parallel loop here
+  for(size_t j=0; j<nsend_total; j++) {
+    size_t i= send_index[j];
+    assert(i < np_local);
+    if(kick_stream) {
+      p[i].v[0] += kick*buf_send[3*j    ];
+      p[i].v[1] += kick*buf_send[3*j + 1];
+      p[i].v[2] += kick*buf_send[3*j + 2];
+    }
+    else {
+      force[i][0] += buf_send[3*j    ];
+      force[i][1] += buf_send[3*j + 1];
+      force[i][2] += buf_send[3*j + 2];
+    }
+  }
+}
 
+void buffer_reserve(const size_t n)
+{
+  // Make sure the send/recv buffers have space for n buffer particles
+  if(n <= nbuf_alloc)
+    return;
+
+  nbuf_alloc= (size_t)(1.25*n);
+  send_index= realloc(send_index, sizeof(size_t)*nbuf_alloc);
+  buf_send= realloc(buf_send, sizeof(float_t)*3*nbuf_alloc);
+  buf_recv= realloc(buf_recv, sizeof(float_t)*3*nbuf_alloc);
+  buf_force= realloc(buf_force, sizeof(float3)*nbuf_alloc);
+
+  if(send_index == 0 || buf_send == 0 || buf_recv == 0 || buf_force == 0)
+    msg_abort("Error: unable to allocate buffer for %lu buffer particles\n",
+	      nbuf_alloc);
+}
@@ -1,7 +1,22 @@
 #ifndef PM_H
 #define PM_H 1
 
-void pm_init(const int nc_pm, const int pm_factor, Mem* const mem_density, Mem* const mem_force, const float_t boxsize);
+#include <stdbool.h>
+
+void pm_init(const int nc_pm, const int pm_factor, Mem* const mem_pm, Mem* const mem_density, Mem* const mem_force, const float_t boxsize);
 void pm_compute_forces(Particles* particles);
+void pm_compute_forces_kick(Particles* particles, const float_t kick);
+size_t pm_mem_size_force(const int nc_pm);
+
+// Green's function G(k) of the PM force, f(k) = -i k G(k) delta(k) up to
+// normalisation, k in units of 2 pi/boxsize; the default is 1/k^2, or
+// 1/(W(k)^2 k^2) with -DDECONVOLUTION
+typedef float_t (*pm_green_function)(const float_t k[]);
+void pm_set_green_function(pm_green_function f);
+
+void pm_set_tiled_assignment(const bool tiled);
+double pm_time_density_assignment(Particles* particles);
+void pm_compute_power_spectrum(Particles* particles, const int nk,
+			       double k[], double P[], double nmode[]);
 
 #endif
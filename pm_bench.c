@@ -0,0 +1,146 @@
+///
+/// \file  pm_bench.c
+/// \brief Benchmark of the atomic and tiled PM density assignment
+///
+/// Usage: mpirun -n <nodes> ./pm_bench <nc_pm> [pm_factor]
+///
+/// Times the density assignment of (nc_pm/pm_factor)^3 particles, near
+/// the lattice as after 2LPT, with 1, 2, 4, ... OMP_NUM_THREADS threads
+/// for both the atomic and the tiled assignment, e.g., for
+/// nc_pm = 192, 384, 768, 1536.
+///
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "config.h"
+#include "particle.h"
+#include "comm.h"
+#include "msg.h"
+#include "mem.h"
+#include "fft.h"
+#include "pm.h"
+#include "domain.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#error "pm_bench requires OpenMP; define OPENMP in the Makefile"
+#endif
+
+static Particles* set_particles(const int nc, const float_t boxsize);
+static double best_time(Particles* particles, const int nrep);
+
+int main(int argc, char* argv[])
+{
+  comm_mpi_init(&argc, &argv);
+  msg_set_loglevel(msg_info);
+
+  if(argc < 2)
+    msg_abort("Usage: pm_bench <nc_pm> [pm_factor]\n");
+
+  const int nc_pm= atoi(argv[1]);
+  const int pm_factor= argc > 2 ? atoi(argv[2]) : 3;
+  const int nc= nc_pm/pm_factor;
+  const float_t boxsize= nc; // particle spacing 1
+
+  if(nc < 1 || nc*pm_factor != nc_pm)
+    msg_abort("Error: nc_pm= %d is not a multiple of pm_factor= %d\n",
+	      nc_pm, pm_factor);
+
+  const int nthread_max= omp_get_max_threads();
+
+  Mem* mem1= mem_init("mem1");
+  mem_reserve(mem1, fft_mem_size_working(nc_pm, 1), "ParticleMesh");
+  mem_alloc_reserved(mem1);
+
+  Mem* mem2= mem_init("mem2");
+  mem_reserve(mem2, fft_mem_size_working(nc_pm, 1), "delta_k");
+  mem_alloc_reserved(mem2);
+
+  pm_init(nc_pm, pm_factor, mem1, mem2, 0, boxsize);
+  domain_init(nc_pm, boxsize);
+
+  Particles* particles= set_particles(nc, boxsize);
+  domain_decompose(particles);
+
+  msg_printf(msg_info, "Density assignment of %d^3 particles on %d^3 mesh, "
+	     "%d nodes\n", nc, nc_pm, comm_n_nodes());
+  msg_printf(msg_info, "threads  atomic [sec]  tiled [sec]  atomic/tiled\n");
+
+  for(int nthread=1; ; nthread *= 2) {
+    if(nthread > nthread_max)
+      nthread= nthread_max;
+    omp_set_num_threads(nthread);
+
+    double t[2];
+    for(int tiled=0; tiled<2; tiled++) {
+      pm_set_tiled_assignment(tiled);
+      t[tiled]= best_time(particles, 3);
+    }
+
+    msg_printf(msg_info, "%7d  %12.4f  %11.4f  %12.2f\n",
+	       nthread, t[0], t[1], t[0]/t[1]);
+
+    if(nthread == nthread_max)
+      break;
+  }
+
+  comm_mpi_finalise();
+  return 0;
+}
+
+Particles* set_particles(const int nc, const float_t boxsize)
+{
+  // Lattice of nc^3 particles in the local slab (pencil) of the particle
+  // lattice, displaced by up to 0.3 spacing in each direction
+  Particles* particles= calloc(sizeof(Particles), 1); assert(particles);
+
+  const size_t nx= fft_local_nx(nc), ix0= fft_local_ix0(nc);
+  const size_t ny= fft_local_ny(nc), iy0= fft_local_iy0(nc);
+
+  size_t np_alloc= (size_t)(1.25*(nx + 1)*(ny + 1)*nc);
+  particles->p= malloc(np_alloc*sizeof(Particle)); assert(particles->p);
+  particles->np_allocated= np_alloc;
+  particles->boxsize= boxsize;
+
+  const float_t dx= boxsize/nc;
+  Particle* p= particles->p;
+  size_t np= 0;
+  for(size_t ix=ix0; ix<ix0 + nx; ix++) {
+    for(size_t iy=iy0; iy<iy0 + ny; iy++) {
+      for(size_t iz=0; iz<nc; iz++) {
+	const size_t index= (ix*nc + iy)*nc + iz;
+	const size_t q[3]= {ix, iy, iz};
+	uint64_t r= index*6364136223846793005ULL + 1442695040888963407ULL;
+	for(int k=0; k<3; k++) {
+	  r= r*6364136223846793005ULL + 1442695040888963407ULL;
+	  const double u= (r >> 11)*(1.0/9007199254740992.0) - 0.5;
+	  p[np].x[k]= pos_add(0, (q[k] + 0.6*u)*dx, boxsize);
+	  p[np].v[k]= 0;
+	  p[np].dx1[k]= 0;
+	  p[np].dx2[k]= 0;
+	}
+	p[np].id= index + 1;
+	np++;
+      }
+    }
+  }
+  particles->np_local= np;
+
+  return particles;
+}
+
+double best_time(Particles* particles, const int nrep)
+{
+  // Minimum wall-clock time of nrep assignments after one warm-up
+  pm_time_density_assignment(particles);
+
+  double t_min= 0.0;
+  for(int rep=0; rep<nrep; rep++) {
+    const double t= pm_time_density_assignment(particles);
+    if(rep == 0 || t < t_min) t_min= t;
+  }
+
+  return t_min;
+}
@@ -39,6 +39,12 @@ PowerSpectrum* power_alloc(const char filename[], const double sigma8_check)
     msg_abort("Error: Not enough power spectrum data points for cubic spline; %d data points < %d required\n", ps->n, n_required);
 
   gsl_interp_init(ps->interp, ps->log_k, ps->log_P, ps->n);
+
+  ps->table_nc= 0;
+  ps->table_boxsize= 0.0;
+  ps->table_n= 0;
+  ps->table_P= NULL;
+  ps->zero_outside= false;
   
   return ps;
 }
@@ -47,6 +53,7 @@ void power_free(PowerSpectrum* ps)
 {
   gsl_interp_accel_free(ps->acc);
   gsl_interp_free(ps->interp);
+  free(ps->table_P);
   free(ps->log_k);
   free(ps);
 }
@@ -57,6 +64,68 @@ double power_spectrum(PowerSpectrum* const ps, const double k)
     gsl_interp_eval(ps->interp, ps->log_k, ps->log_P, log(k), ps->acc);
   return exp(log_P);
 }
+
+void power_set_zero_outside(PowerSpectrum* const ps, const bool zero)
+{
+  // P(k)= 0 for wavenumbers outside the input file in power_tabulate(),
+  // with a warning, instead of abort (default)
+  ps->zero_outside= zero;
+  free(ps->table_P);
+  ps->table_P= NULL;
+}
+
+void power_tabulate(PowerSpectrum* const ps, const int nc, const double boxsize)
+{
+  // Tabulates P(k) for all |k|^2 = (2pi/boxsize)^2 n2 on a periodic nc^3
+  // grid, n2 = kx^2 + ky^2 + kz^2 in integer units, up to the corner of
+  // the Nyquist cube. Far fewer values than modes, and the lookup
+  // power_spectrum_k2 does not share the interpolation accelerator.
+  // Built once per (nc, boxsize). A k used by the IC generators outside
+  // the range of the input file is an error, or P= 0 after
+  // power_set_zero_outside().
+  if(ps->table_P && ps->table_nc == nc && ps->table_boxsize == boxsize)
+    return;
+
+  const size_t nh= nc/2;
+  const size_t n= 3*nh*nh + 1;
+
+  free(ps->table_P);
+  ps->table_P= malloc(sizeof(double)*n); assert(ps->table_P);
+  ps->table_nc= nc;
+  ps->table_boxsize= boxsize;
+  ps->table_n= n;
+
+  const double dk= 2.0*M_PI/boxsize;
+  const double log_kmin= ps->log_k[0];
+  const double log_kmax= ps->log_k[ps->n - 1];
+#ifdef SPHEREMODE
+  const size_t n2_used= nh*nh; // modes within the Nyquist sphere
+#else
+  const size_t n2_used= n - 1;
+#endif
+  size_t n_outside= 0;
+  double k_outside= 0.0;
+
+  ps->table_P[0]= 0.0;
+  for(size_t n2=1; n2<n; n2++) {
+    const double log_k= log(dk*sqrt((double) n2));
+    if(log_k < log_kmin || log_k > log_kmax) {
+      ps->table_P[n2]= 0.0;
+      if(n2 <= n2_used && n_outside++ == 0)
+	k_outside= exp(log_k);
+    }
+    else
+      ps->table_P[n2]= exp(gsl_interp_eval(ps->interp, ps->log_k, ps->log_P,
+					   log_k, ps->acc));
+  }
+
+  if(n_outside > 0 && !ps->zero_outside)
+    msg_abort("Error: %lu wavenumbers, e.g. k= %e, are outside the power spectrum file [%e, %e]; extend the file or use power_set_zero_outside()\n", n_outside, k_outside, exp(log_kmin), exp(log_kmax));
+  else if(n_outside > 0)
+    msg_printf(msg_warn, "Warning: %lu wavenumbers are outside the power spectrum file; P(k) set to zero\n", n_outside);
+
+  msg_printf(msg_verbose, "Power spectrum tabulated for %lu values of k^2, %.1f MB\n", n, sizeof(double)*n/(1024.0*1024.0));
+}
   
 
 void read_power_spectrum_file(const char filename[], const double sigma8_check, PowerSpectrum* const ps)
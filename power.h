@@ -1,6 +1,7 @@
 #ifndef POWER_H
 #define POWER_H 1
 
+#include <stdbool.h>
 #include <gsl/gsl_spline.h>
 
 typedef struct {
@@ -9,11 +10,26 @@ typedef struct {
   double* log_P;           // logP= log_k + n
   gsl_interp *interp;
   gsl_interp_accel *acc;
+  int table_nc;            // P(k) tabulated for a nc^3 grid of table_boxsize
+  double table_boxsize;
+  size_t table_n;
+  double* table_P;         // table_P[n2]= P(2pi/boxsize*sqrt(n2))
+  bool zero_outside;       // P= 0 outside the file instead of abort
 } PowerSpectrum;
 
 PowerSpectrum* power_alloc(const char filename[], const double sigma8_check);
 void power_free(PowerSpectrum* ps);
 
 double power_spectrum(PowerSpectrum* const ps, const double k);
+void power_tabulate(PowerSpectrum* const ps, const int nc, const double boxsize);
+void power_set_zero_outside(PowerSpectrum* const ps, const bool zero);
+
+static inline double power_spectrum_k2(PowerSpectrum const * const ps,
+				       const size_t n2)
+{
+  // P(k) for |k|^2 = (2pi/boxsize)^2 n2 on the grid of power_tabulate.
+  // Read only; safe to call from many threads
+  return ps->table_P[n2];
+}
 
 #endif
@@ -11,11 +11,14 @@ size_t mbytes(size_t bytes);
 
 static inline void periodic_wrapup_p(Particle* const p, const float_t boxsize)
 {
+  // FIXED_POSITION positions are always in the box
+#ifndef FIXED_POSITION
   for(int k=0; k<3; k++) {
     while(p->x[k] < 0) p->x[k] += boxsize;
     while(p->x[k] >= boxsize) p->x[k] -= boxsize;
     assert(0 <= p->x[k] && p->x[k] < boxsize); // !!! heavy assert !!!
   }
+#endif
 }
 
 
@@ -1,6 +1,47 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
 #include <assert.h>
+#include <mpi.h>
 #include "particle.h"
+#include "msg.h"
+#include "util.h"
+#include "write.h"
+
+// Particles per MPI-IO call; bounds the staging buffer to 24 bytes times this
+static const size_t nchunk= 1 << 20;
+
+// Asynchronous snapshots in flight; double buffered
+typedef struct {
+  bool        active;
+  char*       filename;
+  MPI_File    fp;
+  MPI_Request req[3];
+  float*      x;        // staging copies of x, v, id
+  float*      v;
+  uint64_t*   id;
+  size_t      nbytes;   // staging memory, maximum over nodes
+} AsyncSnapshot;
+
+static AsyncSnapshot async_snp[2];
+static int async_next;           // slot of the next asynchronous snapshot
+static size_t async_bytes;       // staging memory in flight
+static size_t async_bytes_max;   // 0 for no limit
+static MPI_Datatype float3_type= MPI_DATATYPE_NULL; // x or v of a particle
+
+// MPI-IO hints of snapshot files; 0 for the defaults in snapshot_info()
+static int striping_factor, striping_unit, cb_nodes;
+static int n_writer_nodes;       // compute nodes (hosts) writing, or 0
+
+static void stage_particles(Particles const * const particles,
+			    const size_t ibegin, const size_t n,
+			    float* const x, float* const v, uint64_t* const id);
+static MPI_File snapshot_open(char const filename[],
+			      Particles const * const particles,
+			      MPI_Offset begin[]);
+static void async_finish(AsyncSnapshot* const snp);
+static MPI_Info snapshot_info(void);
 
 void write_particles_txt(char filename[], Particles* particles, const float dx)
 {
@@ -14,7 +55,7 @@ void write_particles_txt(char filename[], Particles* particles, const float dx)
     const float_t boxsize= particles->boxsize;
 
     for(int k=0; k<3; k++) {
-      x[k]= p[i].x[k];
+      x[k]= pos_to_x(p[i].x[k], boxsize);
       if(x[k] < 0) x[k] += boxsize;
       if(x[k] >= boxsize) x[k] -= boxsize;
     }
@@ -29,3 +70,314 @@ void write_particles_txt(char filename[], Particles* particles, const float dx)
   printf("%s written\n", filename);
 }
 
+void write_snapshot(char const filename[], Particles const * const particles)
+{
+  // Binary snapshot written collectively with MPI-IO.
+  // Layout: SnapshotHeader, uint64_t offset[n_nodes],
+  //         float x[np_total][3], float v[np_total][3],
+  //         uint64_t id[np_total]
+  // Particles of node i are at offset[i] ... offset[i+1]-1 of each block.
+  // Positions are periodically wrapped to 0 <= x < boxsize.
+  const size_t np= particles->np_local;
+
+  // All nodes make the same number of collective calls
+  unsigned long long nwrite= (np + nchunk - 1)/nchunk, nwrite_max;
+  MPI_Allreduce(&nwrite, &nwrite_max, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX,
+		MPI_COMM_WORLD);
+
+  MPI_Offset begin[3];
+  MPI_File fp= snapshot_open(filename, particles, begin);
+
+  float* const x= malloc(3*sizeof(float)*nchunk); assert(x);
+  uint64_t* const id= malloc(sizeof(uint64_t)*nchunk); assert(id);
+  
+  for(size_t iwrite=0; iwrite<nwrite_max; iwrite++) {
+    const size_t ibegin= iwrite*nchunk < np ? iwrite*nchunk : np;
+    const size_t n= ibegin + nchunk < np ? nchunk : np - ibegin;
+    MPI_Status status;
+
+    // x and v share the staging buffer
+    stage_particles(particles, ibegin, n, x, 0, 0);
+    MPI_File_write_at_all(fp, begin[0] + 3*sizeof(float)*ibegin,
+			  x, 3*n, MPI_FLOAT, &status);
+
+    stage_particles(particles, ibegin, n, 0, x, id);
+    MPI_File_write_at_all(fp, begin[1] + 3*sizeof(float)*ibegin,
+			  x, 3*n, MPI_FLOAT, &status);
+    MPI_File_write_at_all(fp, begin[2] + sizeof(uint64_t)*ibegin,
+			  id, n, MPI_UNSIGNED_LONG_LONG, &status);
+  }
+
+  free(id);
+  free(x);
+  MPI_File_close(&fp);
+
+  msg_printf(msg_info, "%s written\n", filename);
+}
+
+void write_snapshot_async(char const filename[],
+			  Particles const * const particles)
+{
+  // Same snapshot as write_snapshot(), but returns after copying the
+  // particles to a staging buffer and starting non-blocking collective
+  // writes. At most two snapshots are in flight, and their staging memory
+  // is limited by write_set_async_memory(). Call on all nodes; the file is
+  // closed by a later write_snapshot_async() or write_finalize().
+  const size_t np= particles->np_local;
+  unsigned long long nbytes= (6*sizeof(float) + sizeof(uint64_t))*np;
+  MPI_Allreduce(MPI_IN_PLACE, &nbytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX,
+		MPI_COMM_WORLD);
+
+  if(async_bytes_max > 0 && nbytes > async_bytes_max) {
+    msg_printf(msg_verbose, "Snapshot staging %lu MB exceeds the limit; "
+	       "writing synchronously\n", mbytes(nbytes));
+    write_snapshot(filename, particles);
+    return;
+  }
+
+  // Free the slot, and memory, for this snapshot; oldest first
+  while(async_snp[async_next].active ||
+	(async_bytes_max > 0 && async_bytes + nbytes > async_bytes_max)) {
+    if(async_snp[async_next].active)
+      async_finish(async_snp + async_next);
+    else
+      async_finish(async_snp + (async_next ^ 1));
+  }
+
+  AsyncSnapshot* const snp= async_snp + async_next;
+  async_next ^= 1;
+
+  snp->x= malloc(3*sizeof(float)*np);
+  snp->v= malloc(3*sizeof(float)*np);
+  snp->id= malloc(sizeof(uint64_t)*np);
+  if(np > 0 && (snp->x == 0 || snp->v == 0 || snp->id == 0))
+    msg_abort("Error: unable to allocate snapshot staging buffer, %lu MB\n",
+	      mbytes(nbytes));
+
+  stage_particles(particles, 0, np, snp->x, snp->v, snp->id);
+
+  // One write per block; counts are in particles, with x and v as
+  // float3_type, so that int counts suffice up to 2^31 - 1 particles
+  if(np > INT_MAX)
+    msg_abort("Error: %lu particles on one node exceed MPI int count\n", np);
+
+  if(float3_type == MPI_DATATYPE_NULL) {
+    MPI_Type_contiguous(3, MPI_FLOAT, &float3_type);
+    MPI_Type_commit(&float3_type);
+  }
+
+  MPI_Offset begin[3];
+  snp->fp= snapshot_open(filename, particles, begin);
+  MPI_File_iwrite_at_all(snp->fp, begin[0], snp->x, np, float3_type,
+			 snp->req);
+  MPI_File_iwrite_at_all(snp->fp, begin[1], snp->v, np, float3_type,
+			 snp->req + 1);
+  MPI_File_iwrite_at_all(snp->fp, begin[2], snp->id, np,
+			 MPI_UNSIGNED_LONG_LONG, snp->req + 2);
+
+  snp->filename= util_new_str(filename);
+  snp->nbytes= nbytes;
+  snp->active= true;
+  async_bytes += nbytes;
+
+  msg_printf(msg_verbose, "%s writing in background\n", filename);
+}
+
+void write_set_async_memory(const size_t nbytes)
+{
+  // Maximum staging memory per node for snapshots in flight; 0 for no
+  // limit other than two snapshots
+  async_bytes_max= nbytes;
+}
+
+void write_set_file_hints(const int striping_factor_,
+			  const int striping_unit_, const int cb_nodes_)
+{
+  // Lustre striping of new snapshot files and the number of collective
+  // buffering nodes; 0 for the default. The environment variables
+  // FS_STRIPING_FACTOR, FS_STRIPING_UNIT, and FS_CB_NODES override these.
+  striping_factor= striping_factor_;
+  striping_unit= striping_unit_;
+  cb_nodes= cb_nodes_;
+}
+
+void write_finalize(void)
+{
+  // Waits for all asynchronous snapshots, oldest first
+  for(int i=0; i<2; i++) {
+    if(async_snp[async_next].active)
+      async_finish(async_snp + async_next);
+    async_next ^= 1;
+  }
+}
+
+//
+// Private (static) functions
+//
+
+void stage_particles(Particles const * const particles,
+		     const size_t ibegin, const size_t n,
+		     float* const x, float* const v, uint64_t* const id)
+{
+  // Copies particles ibegin ... ibegin + n - 1 to the output arrays that
+  // are not 0; positions are wrapped to the box
+  const float_t boxsize= particles->boxsize;
+  Particle const * const p= particles->p + ibegin;
+
+  if(x) {
+    for(size_t i=0; i<n; i++) {
+      for(int k=0; k<3; k++) {
+	float_t xx= pos_to_x(p[i].x[k], boxsize);
+	if(xx < 0) xx += boxsize;
+	if(xx >= boxsize) xx -= boxsize;
+	x[3*i + k]= xx;
+      }
+    }
+  }
+
+  if(v) {
+    for(size_t i=0; i<n; i++)
+      for(int k=0; k<3; k++)
+	v[3*i + k]= p[i].v[k];
+  }
+
+  if(id) {
+    for(size_t i=0; i<n; i++)
+      id[i]= particle_id(p + i);
+  }
+}
+
+MPI_File snapshot_open(char const filename[],
+		       Particles const * const particles, MPI_Offset begin[])
+{
+  // Opens the snapshot collectively and writes the header from node 0.
+  // begin[] are the file offsets of this node's x, v, and id data
+  int this_node, n_nodes;
+  MPI_Comm_rank(MPI_COMM_WORLD, &this_node);
+  MPI_Comm_size(MPI_COMM_WORLD, &n_nodes);
+
+  unsigned long long np_local= particles->np_local, offset= 0, np_total= 0;
+  MPI_Exscan(&np_local, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+	     MPI_COMM_WORLD);
+  if(this_node == 0)
+    offset= 0; // MPI_Exscan leaves rank 0 undefined
+  MPI_Allreduce(&np_local, &np_total, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+		MPI_COMM_WORLD);
+
+  uint64_t* const offsets= malloc(sizeof(uint64_t)*n_nodes);
+  assert(offsets);
+  MPI_Gather(&offset, 1, MPI_UNSIGNED_LONG_LONG,
+	     offsets, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+
+  // Striping applies only when the file is created
+  if(this_node == 0)
+    MPI_File_delete((char*) filename, MPI_INFO_NULL);
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  MPI_Info info= snapshot_info();
+
+  MPI_File fp;
+  int ret= MPI_File_open(MPI_COMM_WORLD, (char*) filename,
+			 MPI_MODE_CREATE | MPI_MODE_WRONLY, info, &fp);
+  MPI_Info_free(&info);
+  if(ret != MPI_SUCCESS)
+    msg_abort("Error: unable to open snapshot %s\n", filename);
+
+  MPI_File_set_errhandler(fp, MPI_ERRORS_ARE_FATAL);
+  MPI_File_set_size(fp, 0);
+
+  if(this_node == 0) {
+    SnapshotHeader header;
+    header.a_x= particles->a_x;
+    header.a_v= particles->a_v;
+    header.boxsize= particles->boxsize;
+    header.omega_m= particles->omega_m;
+    header.np_total= np_total;
+    header.n_nodes= n_nodes;
+
+    MPI_Status status;
+    MPI_File_write_at(fp, 0, &header, sizeof(SnapshotHeader), MPI_BYTE,
+		      &status);
+    MPI_File_write_at(fp, sizeof(SnapshotHeader), offsets,
+		      n_nodes*sizeof(uint64_t), MPI_BYTE, &status);
+  }
+  free(offsets);
+
+  const MPI_Offset x_begin= sizeof(SnapshotHeader) + n_nodes*sizeof(uint64_t);
+  const MPI_Offset v_begin= x_begin + 3*sizeof(float)*np_total;
+  const MPI_Offset id_begin= v_begin + 3*sizeof(float)*np_total;
+
+  begin[0]= x_begin + 3*sizeof(float)*offset;
+  begin[1]= v_begin + 3*sizeof(float)*offset;
+  begin[2]= id_begin + sizeof(uint64_t)*offset;
+
+  return fp;
+}
+
+static int hint_value(char const name[], const int value)
+{
+  // Value of environment variable name if set, otherwise value
+  char const * const env= getenv(name);
+  return env ? atoi(env) : value;
+}
+
+MPI_Info snapshot_info(void)
+{
+  // Hints for the snapshot file: collective buffering with one
+  // aggregator per compute node by default, and Lustre striping over as
+  // many OSTs as aggregators in 4 MB stripes. Other file systems ignore
+  // the striping hints.
+  if(n_writer_nodes == 0) {
+    MPI_Comm comm_node;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+			MPI_INFO_NULL, &comm_node);
+    int node_rank;
+    MPI_Comm_rank(comm_node, &node_rank);
+    MPI_Comm_free(&comm_node);
+
+    int leader= node_rank == 0;
+    MPI_Allreduce(&leader, &n_writer_nodes, 1, MPI_INT, MPI_SUM,
+		  MPI_COMM_WORLD);
+  }
+
+  const int n_cb= hint_value("FS_CB_NODES",
+			     cb_nodes > 0 ? cb_nodes : n_writer_nodes);
+  const int n_stripe= hint_value("FS_STRIPING_FACTOR",
+				 striping_factor > 0 ? striping_factor : n_cb);
+  const int stripe_unit= hint_value("FS_STRIPING_UNIT",
+			     striping_unit > 0 ? striping_unit : 4*1024*1024);
+
+  MPI_Info info;
+  MPI_Info_create(&info);
+  MPI_Info_set(info, "romio_cb_write", "enable");
+
+  char value[16];
+  sprintf(value, "%d", n_cb);
+  MPI_Info_set(info, "cb_nodes", value);
+  sprintf(value, "%d", n_stripe);
+  MPI_Info_set(info, "striping_factor", value);
+  sprintf(value, "%d", stripe_unit);
+  MPI_Info_set(info, "striping_unit", value);
+
+  msg_printf(msg_verbose, "Snapshot hints: cb_nodes %d, striping_factor %d, "
+	     "striping_unit %d\n", n_cb, n_stripe, stripe_unit);
+
+  return info;
+}
+
+void async_finish(AsyncSnapshot* const snp)
+{
+  // Waits for the writes of snp, closes the file, and frees the staging
+  // buffer; collective
+  MPI_Waitall(3, snp->req, MPI_STATUSES_IGNORE);
+  MPI_File_close(&snp->fp);
+
+  free(snp->x);
+  free(snp->v);
+  free(snp->id);
+  async_bytes -= snp->nbytes;
+  snp->active= false;
+
+  msg_printf(msg_info, "%s written\n", snp->filename);
+  free(snp->filename);
+}
@@ -1,6 +1,23 @@
 #ifndef WRITE_H
 #define WRITE_H 1
 
+#include <stdint.h>
+
+// Header of the binary snapshot, followed by uint64_t offset[n_nodes] and
+// the x, v, id blocks; see write_snapshot()
+typedef struct {
+  double   a_x, a_v, boxsize, omega_m;
+  uint64_t np_total;
+  uint64_t n_nodes;
+} SnapshotHeader;
+
 void write_particles_txt(char filename[], Particles* particles, const float dx);
+void write_snapshot(char const filename[], Particles const * const particles);
+void write_snapshot_async(char const filename[],
+			  Particles const * const particles);
+void write_set_async_memory(const size_t nbytes);
+void write_set_file_hints(const int striping_factor,
+			  const int striping_unit, const int cb_nodes);
+void write_finalize(void);
 
 #endif